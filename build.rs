@@ -36,6 +36,7 @@ fn main() {
     .include("src/gckimg/libjpeg")
     .include("src/gckimg/libpng")
     .include("src/gckimg")
+    .file("src/gckimg/clut_cache.c")
     .file("src/gckimg/color_mgmt.c")
     .file("src/gckimg/ns_jpeg_decoder.c")
     .file("src/gckimg/ns_png_decoder.c")
@@ -48,6 +49,7 @@ fn main() {
     // TODO: platform-dependent vectorized sources.
     .file("src/gckimg/qcms/transform-sse1.c")
     .file("src/gckimg/qcms/transform-sse2.c")
+    .file("src/gckimg/qcms/transform-avx2.c")
     .file("src/gckimg/qcms/transform_util.c")
     .compile("libgckimg_native.a");
 
@@ -98,6 +100,7 @@ fn main() {
     // TODO: target feature test?
     // TODO: platform-dependent vectorized sources.
     .file("src/gckimg/libjpeg/simd/jsimd_x86_64.c")
+    .file("src/gckimg/libjpeg/simd/jidctint-avx2.c")
     .compile("libgckimg_native_jpeg.a");
 
   fs::remove_file(out_dir.join("libgckimg_native_jpeg_simd.a")).ok();
@@ -175,13 +178,29 @@ fn main() {
     .whitelist_type("NSPngDecoderCtx")
     .whitelist_function("gckimg_color_mgmt_init_default")
     .whitelist_function("gckimg_color_mgmt_cleanup")
+    .whitelist_function("gckimg_color_mgmt_set_clut_cache_dir")
     .whitelist_function("gckimg_ns_jpeg_sizeof")
     .whitelist_function("gckimg_ns_jpeg_init")
     .whitelist_function("gckimg_ns_jpeg_cleanup")
+    .whitelist_function("gckimg_ns_jpeg_reset")
+    .whitelist_function("gckimg_ns_jpeg_set_target_size")
+    .whitelist_function("gckimg_ns_jpeg_set_region")
+    .whitelist_function("gckimg_ns_jpeg_set_final_pass_only")
+    .whitelist_function("gckimg_ns_jpeg_set_scan_limit")
+    .whitelist_function("gckimg_ns_jpeg_set_quality")
+    .whitelist_function("gckimg_ns_jpeg_begin")
+    .whitelist_function("gckimg_ns_jpeg_feed")
+    .whitelist_function("gckimg_ns_jpeg_finish")
     .whitelist_function("gckimg_ns_jpeg_decode")
     .whitelist_function("gckimg_ns_png_sizeof")
     .whitelist_function("gckimg_ns_png_init")
     .whitelist_function("gckimg_ns_png_cleanup")
+    .whitelist_function("gckimg_ns_png_reset")
+    .whitelist_function("gckimg_ns_png_set_final_pass_only")
+    .whitelist_function("gckimg_ns_png_set_target_size")
+    .whitelist_function("gckimg_ns_png_begin")
+    .whitelist_function("gckimg_ns_png_feed")
+    .whitelist_function("gckimg_ns_png_finish")
     .whitelist_function("gckimg_ns_png_decode")
     .generate()
     .unwrap()
@@ -0,0 +1,336 @@
+use ::*;
+use color::*;
+use decoders::*;
+use decoders::jpeg::*;
+use decoders::png::*;
+use exif::*;
+use ffi::gckimg::*;
+
+use std::cmp::{Reverse};
+use std::os::raw::{c_void};
+use std::slice::{from_raw_parts};
+use std::sync::{Arc};
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::thread;
+
+#[derive(Clone, Copy, PartialEq, Eq, Debug)]
+pub enum DecodeError {
+  /// The input is not a JPEG or a PNG.
+  UnknownFormat,
+  /// The decoder gave up on the input.
+  Corrupt,
+}
+
+#[derive(Clone, Debug)]
+pub struct BatchOptions {
+  num_threads:  usize,
+  decode:       DecodeOptions,
+  max_size:     Option<(usize, usize)>,
+  cm:           Option<Arc<ColorMgmt>>,
+}
+
+impl Default for BatchOptions {
+  fn default() -> Self {
+    BatchOptions{
+      num_threads:  0,
+      decode:       DecodeOptions::default(),
+      max_size:     None,
+      cm:           None,
+    }
+  }
+}
+
+impl BatchOptions {
+  /// The number of worker threads; zero (the default) means one per CPU.
+  pub fn with_num_threads(mut self, num_threads: usize) -> BatchOptions {
+    self.num_threads = num_threads;
+    self
+  }
+
+  /// Whether to convert images with an embedded color profile to sRGB (the
+  /// default).
+  pub fn with_color_mgmt(mut self, color_mgmt: bool) -> BatchOptions {
+    self.decode.color_mgmt = color_mgmt;
+    self
+  }
+
+  /// Share `cm` between all the workers, in place of a default context for
+  /// each. This is how to decode with `ColorMgmt::with_iccv4` or a CLUT
+  /// cache, and to keep its transforms from one batch to the next.
+  pub fn with_color_mgmt_ctx(mut self, cm: Arc<ColorMgmt>) -> BatchOptions {
+    self.cm = Some(cm);
+    self
+  }
+
+  /// The speed/quality trade-offs to decode with (see `DecodeOptions`).
+  pub fn with_decode_options(mut self, decode: DecodeOptions) -> BatchOptions {
+    self.decode = decode;
+    self
+  }
+
+  /// Decode each image as `ColorImage::decode_with_max_size` would.
+  pub fn with_max_size(mut self, width: usize, height: usize) -> BatchOptions {
+    self.max_size = Some((width, height));
+    self
+  }
+}
+
+/// The raster a worker decodes an image into. pillowimage makes no promise
+/// that its images can be allocated or handed between threads, so the
+/// workers leave `ColorImage` alone, and `decode_batch` copies their rows
+/// into one on the calling thread.
+struct BatchRaster {
+  width:    usize,
+  height:   usize,
+  exif_rot: Option<i32>,
+  data:     Vec<u8>,
+}
+
+unsafe extern "C" fn batch_raster_init_size(img_p: *mut c_void, width: usize, height: usize) {
+  assert!(!img_p.is_null());
+  let img = &mut *(img_p as *mut BatchRaster);
+  img.width = width;
+  img.height = height;
+  img.data.clear();
+  img.data.resize(4 * width * height, 0xff);
+}
+
+unsafe extern "C" fn batch_raster_write_row_gray(img_p: *mut c_void, row_idx: usize, row_buf: *const u8, row_width: usize) {
+  assert!(!img_p.is_null());
+  let img = &mut *(img_p as *mut BatchRaster);
+
+  assert!(!row_buf.is_null());
+  let row = from_raw_parts(row_buf, row_width);
+
+  assert_eq!(row_width, img.width);
+  let dst_line = &mut img.data[4 * row_width * row_idx .. 4 * row_width * (row_idx + 1)];
+  for i in 0 .. row_width {
+    dst_line[4 * i]     = row[i];
+    dst_line[4 * i + 1] = row[i];
+    dst_line[4 * i + 2] = row[i];
+    dst_line[4 * i + 3] = 0xff;
+  }
+}
+
+unsafe extern "C" fn batch_raster_write_row_grayx(img_p: *mut c_void, row_idx: usize, row_buf: *const u8, row_width: usize) {
+  assert!(!img_p.is_null());
+  let img = &mut *(img_p as *mut BatchRaster);
+
+  assert!(!row_buf.is_null());
+  let row = from_raw_parts(row_buf, 2 * row_width);
+
+  assert_eq!(row_width, img.width);
+  let dst_line = &mut img.data[4 * row_width * row_idx .. 4 * row_width * (row_idx + 1)];
+  for i in 0 .. row_width {
+    dst_line[4 * i]     = row[2 * i];
+    dst_line[4 * i + 1] = row[2 * i];
+    dst_line[4 * i + 2] = row[2 * i];
+    dst_line[4 * i + 3] = row[2 * i + 1];
+  }
+}
+
+unsafe extern "C" fn batch_raster_write_row_rgb(img_p: *mut c_void, row_idx: usize, row_buf: *const u8, row_width: usize) {
+  assert!(!img_p.is_null());
+  let img = &mut *(img_p as *mut BatchRaster);
+
+  assert!(!row_buf.is_null());
+  let row = from_raw_parts(row_buf, 3 * row_width);
+
+  assert_eq!(row_width, img.width);
+  let dst_line = &mut img.data[4 * row_width * row_idx .. 4 * row_width * (row_idx + 1)];
+  for i in 0 .. row_width {
+    dst_line[4 * i]     = row[3 * i];
+    dst_line[4 * i + 1] = row[3 * i + 1];
+    dst_line[4 * i + 2] = row[3 * i + 2];
+  }
+}
+
+unsafe extern "C" fn batch_raster_write_row_rgbx(img_p: *mut c_void, row_idx: usize, row_buf: *const u8, row_width: usize) {
+  assert!(!img_p.is_null());
+  let img = &mut *(img_p as *mut BatchRaster);
+
+  assert!(!row_buf.is_null());
+  let row = from_raw_parts(row_buf, 4 * row_width);
+
+  assert_eq!(row_width, img.width);
+  img.data[4 * row_width * row_idx .. 4 * row_width * (row_idx + 1)].copy_from_slice(row);
+}
+
+unsafe extern "C" fn batch_raster_write_rows_rgbx(img_p: *mut c_void, row_idx: usize, num_rows: usize, rows_buf: *const u8, row_stride: usize, row_width: usize) {
+  for r in 0 .. num_rows {
+    batch_raster_write_row_rgbx(img_p, row_idx + r, rows_buf.offset((r * row_stride) as isize), row_width);
+  }
+}
+
+unsafe extern "C" fn batch_raster_get_row_buffer(img_p: *mut c_void, row_idx: usize) -> *mut u8 {
+  assert!(!img_p.is_null());
+  let img = &mut *(img_p as *mut BatchRaster);
+  let row_size = 4 * img.width;
+  img.data[row_size * row_idx ..].as_mut_ptr()
+}
+
+unsafe extern "C" fn batch_raster_parse_exif(img_p: *mut c_void, exif_buf: *const u8, exif_size: usize) -> i32 {
+  assert!(!img_p.is_null());
+  let img = &mut *(img_p as *mut BatchRaster);
+  assert!(!exif_buf.is_null());
+  let raw_exif = from_raw_parts(exif_buf, exif_size);
+  let exif_rot = parse_exif(raw_exif).unwrap_or(0);
+  if exif_rot >= 1 && exif_rot <= 8 {
+    img.exif_rot = Some(exif_rot);
+  } else {
+    img.exif_rot = None;
+  }
+  exif_rot
+}
+
+impl ImageWriter for BatchRaster {
+  fn callbacks() -> ImageWriterCallbacks {
+    ImageWriterCallbacks{
+      init_size:        Some(batch_raster_init_size),
+      write_row_gray:   Some(batch_raster_write_row_gray),
+      write_row_grayx:  Some(batch_raster_write_row_grayx),
+      write_row_rgb:    Some(batch_raster_write_row_rgb),
+      write_row_rgbx:   Some(batch_raster_write_row_rgbx),
+      write_rows_rgbx:  Some(batch_raster_write_rows_rgbx),
+      get_row_buffer:   Some(batch_raster_get_row_buffer),
+      parse_exif:       Some(batch_raster_parse_exif),
+      // The same layout as `ColorImage`, so that the rows copy straight in.
+      pixel_format:     PixelFormat::Rgbx as _,
+    }
+  }
+}
+
+impl BatchRaster {
+  fn new() -> BatchRaster {
+    BatchRaster{
+      width:    0,
+      height:   0,
+      exif_rot: None,
+      data:     vec![],
+    }
+  }
+
+  fn into_image(self) -> ColorImage {
+    ColorImage::from_rgbx(self.width, self.height, &self.data, self.exif_rot)
+  }
+}
+
+/// A worker's decoders. They live as long as the `BatchDecoder` does, so
+/// each one keeps the same decoder context (see `DecoderPool`) and color
+/// management context, with its cache of profiles and transforms, for all
+/// of its images.
+struct BatchWorker {
+  jpeg: NSJpegDecoder,
+  png:  NSPngDecoder,
+}
+
+impl BatchWorker {
+  fn new(opts: &BatchOptions) -> BatchWorker {
+    // Unless one is given, a context per worker keeps the workers from
+    // contending for the lock on a shared cache; the precached sRGB output
+    // profile is still shared.
+    let cm = match (opts.decode.color_mgmt, &opts.cm) {
+      (false, _) => None,
+      (true, &Some(ref cm)) => Some(cm.clone()),
+      (true, &None) => Some(Arc::new(ColorMgmt::default())),
+    };
+    let mut jpeg = NSJpegDecoder::with_color_mgmt(cm.clone()).with_options(opts.decode);
+    let mut png = NSPngDecoder::with_color_mgmt(cm).with_options(opts.decode);
+    if let Some((width, height)) = opts.max_size {
+      jpeg = jpeg.with_target_size(width, height);
+      png = png.with_target_size(width, height);
+    }
+    BatchWorker{
+      jpeg: jpeg,
+      png:  png,
+    }
+  }
+
+  fn decode(&mut self, buf: &[u8]) -> Result<BatchRaster, DecodeError> {
+    let mut image = BatchRaster::new();
+    let res = match decodable_image_format(buf) {
+      Some(ImageFormat::Jpeg) => self.jpeg.decode(buf, &mut image),
+      Some(ImageFormat::Png)  => self.png.decode(buf, &mut image),
+      _ => return Err(DecodeError::UnknownFormat),
+    };
+    match res {
+      Ok(_) => Ok(image),
+      Err(_) => Err(DecodeError::Corrupt),
+    }
+  }
+}
+
+/// Decodes batches of JPEGs and PNGs on a pool of worker threads.
+///
+/// The workers' decoders and color management contexts are kept from one
+/// batch to the next, so a long-lived `BatchDecoder` only sets them up once;
+/// the threads themselves are started for each batch.
+pub struct BatchDecoder {
+  opts:     BatchOptions,
+  workers:  Vec<BatchWorker>,
+}
+
+impl BatchDecoder {
+  pub fn new(opts: BatchOptions) -> BatchDecoder {
+    BatchDecoder{
+      opts:     opts,
+      workers:  vec![],
+    }
+  }
+
+  /// Decode `inputs`, returning the results in the same order.
+  ///
+  /// The images are handed out largest first, by the pixel count in their
+  /// headers, and each worker takes the next one as soon as it is free, so
+  /// that a big image is not left to run alone at the end of the batch.
+  pub fn decode(&mut self, inputs: &[&[u8]]) -> Vec<Result<ColorImage, DecodeError>> {
+    let mut order: Vec<usize> = (0 .. inputs.len()).collect();
+    order.sort_by_cached_key(|&idx| {
+      Reverse(probe_image(inputs[idx]).map(|info| info.width * info.height).unwrap_or(0))
+    });
+
+    let num_threads = match self.opts.num_threads {
+      0 => thread::available_parallelism().map(|n| n.get()).unwrap_or(1),
+      n => n,
+    };
+    let num_threads = num_threads.min(inputs.len()).max(1);
+    while self.workers.len() < num_threads {
+      let worker = BatchWorker::new(&self.opts);
+      self.workers.push(worker);
+    }
+
+    let next = AtomicUsize::new(0);
+    let mut results: Vec<Option<Result<BatchRaster, DecodeError>>> = (0 .. inputs.len()).map(|_| None).collect();
+    thread::scope(|scope| {
+      let threads: Vec<_> = self.workers[ .. num_threads].iter_mut().map(|worker| {
+        let order = &order;
+        let next = &next;
+        scope.spawn(move || {
+          let mut done = vec![];
+          loop {
+            let rank = next.fetch_add(1, Ordering::Relaxed);
+            if rank >= order.len() {
+              break;
+            }
+            let idx = order[rank];
+            done.push((idx, worker.decode(inputs[idx])));
+          }
+          done
+        })
+      }).collect();
+      for handle in threads {
+        for (idx, res) in handle.join().unwrap() {
+          results[idx] = Some(res);
+        }
+      }
+    });
+    results.into_iter().map(|res| res.unwrap().map(|raster| raster.into_image())).collect()
+  }
+}
+
+/// Decode a batch of JPEGs and PNGs on a pool of worker threads, returning
+/// the results in the order of `inputs` (see `BatchDecoder::decode`). To
+/// keep the workers' contexts for later batches, use a `BatchDecoder`.
+pub fn decode_batch(inputs: &[&[u8]], opts: &BatchOptions) -> Vec<Result<ColorImage, DecodeError>> {
+  BatchDecoder::new(opts.clone()).decode(inputs)
+}
@@ -1,22 +1,37 @@
 use ffi::gckimg::*;
 
-use std::cell::{RefCell};
+use std::ffi::{CString};
+use std::fmt;
 use std::mem::{zeroed};
+use std::os::unix::ffi::{OsStrExt};
+use std::path::{Path};
+use std::sync::{Arc, OnceLock};
 
-thread_local! {
-  pub static COLOR_MGMT: RefCell<ColorMgmt> = RefCell::new(ColorMgmt::default());
-}
+static COLOR_MGMT: OnceLock<Arc<ColorMgmt>> = OnceLock::new();
 
 pub struct ColorMgmt {
   pub ctx:  ColorMgmtCtx,
 }
 
+// After `gckimg_color_mgmt_init_default`, the context is only ever read by
+// the decoders, so a single instance can be shared between threads.
+unsafe impl Send for ColorMgmt {}
+unsafe impl Sync for ColorMgmt {}
+
 impl Drop for ColorMgmt {
   fn drop(&mut self) {
     unsafe { gckimg_color_mgmt_cleanup(&mut self.ctx as *mut _) };
   }
 }
 
+impl fmt::Debug for ColorMgmt {
+  fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+    f.debug_struct("ColorMgmt")
+      .field("iccv4", &(self.ctx.iccv4 != 0))
+      .finish()
+  }
+}
+
 impl Default for ColorMgmt {
   fn default() -> Self {
     let mut ctx: ColorMgmtCtx = unsafe { zeroed() };
@@ -24,3 +39,28 @@ impl Default for ColorMgmt {
     ColorMgmt{ctx:  ctx}
   }
 }
+
+impl ColorMgmt {
+  /// The process-wide default color management context (sRGB output).
+  pub fn shared() -> Arc<ColorMgmt> {
+    COLOR_MGMT.get_or_init(|| Arc::new(ColorMgmt::default())).clone()
+  }
+
+  /// Use the LUTs (A2B0/B2A0) of ICC v4 style profiles instead of their
+  /// matrix/TRC approximation, and accept profiles that only have LUTs.
+  pub fn with_iccv4(mut self, enable: bool) -> ColorMgmt {
+    self.ctx.iccv4 = enable as _;
+    self
+  }
+
+  /// Keep the sampled CLUTs of ICC v4 LUT profiles in `dir`, so that later
+  /// processes can skip rebuilding them. Only used together with
+  /// `with_iccv4(true)`. A path with an interior NUL can't be passed on, and
+  /// leaves the cache off.
+  pub fn with_clut_cache_dir<P: AsRef<Path>>(mut self, dir: P) -> ColorMgmt {
+    if let Ok(dir) = CString::new(dir.as_ref().as_os_str().as_bytes()) {
+      unsafe { gckimg_color_mgmt_set_clut_cache_dir(&mut self.ctx as *mut _, dir.as_ptr()) };
+    }
+    self
+  }
+}
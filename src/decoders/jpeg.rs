@@ -1,40 +1,437 @@
 use ::*;
 use color::*;
+use decoders::{DECODER_POOL, DECODER_POOL_MAX_SPARE, DecodeOptions, Progress};
+use exif::{parse_exif};
 use ffi::gckimg::*;
 
+use std::cmp::{min};
+use std::marker::{PhantomData};
 use std::mem::{size_of, zeroed};
+use std::ptr::{null};
+use std::sync::{Arc};
+
+/// A libjpeg context that is initialized once and then reused for image
+/// after image; decoders get theirs from the thread's `DecoderPool`.
+pub struct NSJpegCtx {
+  ctx:        Box<NSJpegDecoderCtx>,
+  color_mgmt: bool,
+}
+
+// Only the decoder holding the context ever uses it, and libjpeg keeps no
+// per-thread state, so a decoder can move to another thread between images
+// (see `BatchDecoder`).
+unsafe impl Send for NSJpegCtx {}
+
+impl Drop for NSJpegCtx {
+  fn drop(&mut self) {
+    unsafe { gckimg_ns_jpeg_cleanup(&mut *self.ctx as *mut _) };
+  }
+}
+
+impl NSJpegCtx {
+  fn new(color_mgmt: bool) -> NSJpegCtx {
+    assert_eq!(size_of::<NSJpegDecoderCtx>(), unsafe { gckimg_ns_jpeg_sizeof() });
+    // libjpeg keeps pointers into the context, so it lives on the heap.
+    let mut ctx: Box<NSJpegDecoderCtx> = Box::new(unsafe { zeroed() });
+    unsafe { gckimg_ns_jpeg_init(
+        &mut *ctx as *mut _,
+        color_mgmt as _) };
+    NSJpegCtx{
+      ctx:        ctx,
+      color_mgmt: color_mgmt,
+    }
+  }
+
+  fn take(color_mgmt: bool) -> NSJpegCtx {
+    let spare = DECODER_POOL.try_with(|pool| {
+      let mut pool = pool.borrow_mut();
+      match pool.jpeg.iter().position(|ctx| ctx.color_mgmt == color_mgmt) {
+        None => None,
+        Some(idx) => Some(pool.jpeg.swap_remove(idx)),
+      }
+    });
+    match spare {
+      Ok(Some(ctx)) => ctx,
+      _ => NSJpegCtx::new(color_mgmt),
+    }
+  }
+
+  fn recycle(self) {
+    // Once the pool is full (or gone, as the thread exits), the context is
+    // dropped here.
+    let _ = DECODER_POOL.try_with(move |pool| {
+      let mut pool = pool.borrow_mut();
+      if pool.jpeg.len() < DECODER_POOL_MAX_SPARE {
+        pool.jpeg.push(self);
+      }
+    });
+  }
+}
 
 pub struct NSJpegDecoder {
-  ctx:  NSJpegDecoderCtx,
+  ctx:  Option<NSJpegCtx>,
+  cm:   Option<Arc<ColorMgmt>>,
+  target_size:  Option<(usize, usize)>,
+  region:       Option<(usize, usize, usize, usize)>,
+  final_pass_only:  bool,
+  scan_limit:   Option<(usize, usize, bool)>,
+  opts:         DecodeOptions,
 }
 
 impl NSJpegDecoder {
   pub fn new(color_mgmt: bool) -> NSJpegDecoder {
-    NSJpegDecoder{ctx: unsafe { zeroed() }}
+    NSJpegDecoder::with_color_mgmt(match color_mgmt {
+      false => None,
+      true  => Some(ColorMgmt::shared()),
+    })
+  }
+
+  pub fn with_color_mgmt(cm: Option<Arc<ColorMgmt>>) -> NSJpegDecoder {
+    NSJpegDecoder{
+      ctx:  None,
+      cm:   cm,
+      target_size:  None,
+      region:       None,
+      final_pass_only:  true,
+      scan_limit:   None,
+      opts:         DecodeOptions::default(),
+    }
+  }
+
+  /// Decode at the smallest DCT scale (1/8, 2/8, ..., 8/8) whose output is
+  /// still at least `width` x `height`. The writer sees the scaled size.
+  pub fn with_target_size(mut self, width: usize, height: usize) -> NSJpegDecoder {
+    self.target_size = Some((width, height));
+    self
+  }
+
+  /// Only decode the `width` x `height` window at (`x`, `y`), in the
+  /// coordinates of the (scaled) output. The writer sees the window as the
+  /// whole image. Fails if the window is empty or doesn't fit.
+  pub fn with_region(mut self, x: usize, y: usize, width: usize, height: usize) -> NSJpegDecoder {
+    self.region = Some((x, y, width, height));
+    self
+  }
+
+  /// Whether progressive JPEGs are decoded in one output pass after all
+  /// their scans are read (the default), rather than with an output pass
+  /// for each scan as it arrives. The final image is the same for complete
+  /// input, so this only matters to writers that look at intermediate rows.
+  pub fn with_final_pass_only(mut self, final_pass_only: bool) -> NSJpegDecoder {
+    self.final_pass_only = final_pass_only;
+    self
+  }
+
+  /// Decode a cheap preview of a progressive (multi-scan) JPEG: stop after
+  /// the first `max_scans` scans, after the scans that fit in the first
+  /// `max_bytes` bytes, or with `dc_scans_only` before the first AC scan, and
+  /// output what those give (with block smoothing). Zero means no limit, and
+  /// at least one scan is always read. Combined with `with_target_size`, a
+  /// DC-only preview at 1/8 scale needs little more than the DC scan.
+  /// Single-scan JPEGs are decoded in full.
+  pub fn with_scan_limit(mut self, max_scans: usize, max_bytes: usize, dc_scans_only: bool) -> NSJpegDecoder {
+    self.scan_limit = Some((max_scans, max_bytes, dc_scans_only));
+    self
+  }
+
+  /// Speed/quality trade-offs, and whether to use the color management
+  /// context for the images that follow.
+  pub fn with_options(mut self, opts: DecodeOptions) -> NSJpegDecoder {
+    self.opts = opts;
+    self
+  }
+
+  /// Like `with_options`, for a decoder that is kept around between images.
+  pub fn set_options(&mut self, opts: DecodeOptions) {
+    self.opts = opts;
+  }
+
+  fn ctx_ptr(&mut self) -> *mut NSJpegDecoderCtx {
+    &mut *self.ctx.as_mut().unwrap().ctx as *mut _
+  }
+
+  fn start(&mut self) -> Result<*const ColorMgmtCtx, ()> {
+    if let Some((x, y, width, height)) = self.region {
+      // The decoder takes a zero width to mean no region.
+      if width == 0 || height == 0 ||
+         x.checked_add(width).map_or(true, |x_end| x_end > u32::max_value() as usize) ||
+         y.checked_add(height).map_or(true, |y_end| y_end > u32::max_value() as usize) {
+        return Err(());
+      }
+    }
+    // The context is fresh, or was reset after the last image; it is set
+    // up with or without color management for good.
+    let color_mgmt = self.cm.is_some() && self.opts.color_mgmt;
+    if self.ctx.as_ref().map_or(false, |ctx| ctx.color_mgmt != color_mgmt) {
+      self.ctx.take().unwrap().recycle();
+    }
+    if self.ctx.is_none() {
+      self.ctx = Some(NSJpegCtx::take(color_mgmt));
+    }
+    let ctx = self.ctx_ptr();
+    let cm_ptr = match (color_mgmt, &self.cm) {
+      (true, &Some(ref cm)) => &cm.ctx as *const _,
+      _ => null(),
+    };
+    unsafe { gckimg_ns_jpeg_set_quality(
+        ctx,
+        self.opts.dct_method as _,
+        self.opts.fancy_upsampling as _,
+        self.opts.block_smoothing as _) };
+    if let Some((width, height)) = self.target_size {
+      unsafe { gckimg_ns_jpeg_set_target_size(
+          ctx,
+          width as _, height as _) };
+    }
+    unsafe { gckimg_ns_jpeg_set_final_pass_only(
+        ctx,
+        self.final_pass_only as _) };
+    if let Some((max_scans, max_bytes, dc_scans_only)) = self.scan_limit {
+      unsafe { gckimg_ns_jpeg_set_scan_limit(
+          ctx,
+          min(max_scans, u32::max_value() as usize) as _, max_bytes,
+          dc_scans_only as _) };
+    }
+    if let Some((x, y, width, height)) = self.region {
+      unsafe { gckimg_ns_jpeg_set_region(
+          ctx,
+          x as _, y as _, width as _, height as _) };
+    }
+    Ok(cm_ptr)
   }
 
   pub fn decode<W>(&mut self, buf: &[u8], writer: &mut W) -> Result<(), ()>
   where W: ImageWriter {
-    self.ctx = unsafe { zeroed() };
-    assert_eq!(size_of::<NSJpegDecoderCtx>(), unsafe { gckimg_ns_jpeg_sizeof() });
-    COLOR_MGMT.with(|cm| {
-      let mut cm = cm.borrow_mut();
-      unsafe { gckimg_ns_jpeg_init(
-          &mut self.ctx as *mut _,
-          // TODO: color mgmt option.
-          1) };
-      unsafe { gckimg_ns_jpeg_decode(
-          &mut self.ctx as *mut _,
-          &mut cm.ctx as *mut _,
-          buf.as_ptr(), buf.len(),
-          (writer as *mut W) as *mut _,
-          <W as ImageWriter>::callbacks(),
-      ) };
-      unsafe { gckimg_ns_jpeg_cleanup(&mut self.ctx as *mut _) };
-    });
-    match self.ctx.errorcode {
+    let cm_ptr = match self.start() {
+      Ok(cm_ptr) => cm_ptr,
+      Err(_) => return Err(()),
+    };
+    let ctx = self.ctx_ptr();
+    unsafe { gckimg_ns_jpeg_decode(
+        ctx,
+        cm_ptr,
+        buf.as_ptr(), buf.len(),
+        (writer as *mut W) as *mut _,
+        <W as ImageWriter>::callbacks(),
+    ) };
+    let errorcode = unsafe { (*ctx).errorcode };
+    unsafe { gckimg_ns_jpeg_reset(ctx) };
+    match errorcode {
+      0 => Ok(()),
+      _ => Err(()),
+    }
+  }
+
+  /// Start an incremental decode: pass the input to `feed` as it arrives,
+  /// then call `finish`. Rows reach the writer as soon as the data for them
+  /// is in, and with `with_final_pass_only(false)` a progressive JPEG gets
+  /// a full output pass whenever a scan completes. Only the `max_scans`
+  /// part of `with_scan_limit` works here, since the others need the whole
+  /// input up front; with them set this fails.
+  pub fn begin<'a, W>(&'a mut self, writer: &'a mut W) -> Result<NSJpegStream<'a, W>, ()>
+  where W: ImageWriter {
+    if let Some((_, max_bytes, dc_scans_only)) = self.scan_limit {
+      if max_bytes != 0 || dc_scans_only {
+        return Err(());
+      }
+    }
+    let cm_ptr = match self.start() {
+      Ok(cm_ptr) => cm_ptr,
+      Err(_) => return Err(()),
+    };
+    unsafe { gckimg_ns_jpeg_begin(
+        self.ctx_ptr(),
+        cm_ptr,
+        (writer as *mut W) as *mut _,
+        <W as ImageWriter>::callbacks(),
+    ) };
+    Ok(NSJpegStream{
+      dec:    self,
+      writer: PhantomData,
+    })
+  }
+}
+
+impl Drop for NSJpegDecoder {
+  fn drop(&mut self) {
+    if let Some(ctx) = self.ctx.take() {
+      ctx.recycle();
+    }
+  }
+}
+
+/// An incremental decode started by `NSJpegDecoder::begin`. Dropping it
+/// before `finish` abandons the decode.
+pub struct NSJpegStream<'a, W: 'a> {
+  dec:    &'a mut NSJpegDecoder,
+  writer: PhantomData<&'a mut W>,
+}
+
+impl<'a, W: 'a> NSJpegStream<'a, W> {
+  /// Decode as far as `buf` and the input before it go. `buf` is not
+  /// needed after this returns.
+  pub fn feed(&mut self, buf: &[u8]) -> Result<Progress, ()> {
+    match unsafe { gckimg_ns_jpeg_feed(
+        self.dec.ctx_ptr(),
+        buf.as_ptr(), buf.len()) } {
+      0 => Ok(Progress::NeedMoreData),
+      1 => Ok(Progress::Done),
+      _ => Err(()),
+    }
+  }
+
+  /// End the input. Fails if the image was cut short or broken.
+  pub fn finish(self) -> Result<(), ()> {
+    let ctx = self.dec.ctx_ptr();
+    unsafe { gckimg_ns_jpeg_finish(ctx) };
+    match unsafe { (*ctx).errorcode } {
       0 => Ok(()),
       _ => Err(()),
     }
   }
 }
+
+impl<'a, W: 'a> Drop for NSJpegStream<'a, W> {
+  fn drop(&mut self) {
+    unsafe { gckimg_ns_jpeg_reset(self.dec.ctx_ptr()) };
+  }
+}
+
+/// The color space of a JPEG's components, as libjpeg would guess it from
+/// the JFIF and Adobe markers and the component IDs.
+#[derive(Clone, Copy, PartialEq, Eq, Debug)]
+pub enum JpegColorSpace {
+  Gray,
+  Rgb,
+  YCbCr,
+  Cmyk,
+  Ycck,
+  Unknown,
+}
+
+/// Read a JPEG's metadata from its markers up to the first scan, without
+/// starting libjpeg.
+pub fn probe_jpeg(buf: &[u8]) -> Result<ImageInfo, ()> {
+  if !buf.starts_with(&JPEG_MAGICNUM) {
+    return Err(());
+  }
+  let mut saw_jfif = false;
+  let mut adobe_transform = None;
+  let mut has_icc = false;
+  let mut exif_rot = None;
+  let mut frame = None;
+  let mut pos = 2;
+  loop {
+    if pos + 2 > buf.len() || buf[pos] != 0xff {
+      return Err(());
+    }
+    let marker = buf[pos + 1];
+    match marker {
+      // Fill bytes.
+      0xff => {
+        pos += 1;
+        continue;
+      }
+      // Markers without a segment.
+      0x01 | 0xd0 ..= 0xd8 => {
+        pos += 2;
+        continue;
+      }
+      0xd9 | 0xda => break,
+      _ => {}
+    }
+    if pos + 4 > buf.len() {
+      return Err(());
+    }
+    let len = ((buf[pos + 2] as usize) << 8) | buf[pos + 3] as usize;
+    if len < 2 || pos + 2 + len > buf.len() {
+      return Err(());
+    }
+    let data = &buf[pos + 4 .. pos + 2 + len];
+    match marker {
+      // JPEG_APP0
+      0xe0 if data.starts_with(b"JFIF\0") => saw_jfif = true,
+      // JPEG_APP0 + 1
+      0xe1 if data.starts_with(b"Exif\0\0") && exif_rot.is_none() => {
+        exif_rot = parse_exif(data).ok();
+      }
+      // JPEG_APP0 + 2, see iccjpeg.c.
+      0xe2 if data.starts_with(b"ICC_PROFILE\0") => has_icc = true,
+      // JPEG_APP0 + 14
+      0xee if data.starts_with(b"Adobe") && data.len() >= 12 => {
+        adobe_transform = Some(data[11]);
+      }
+      // SOFn; 0xc4, 0xc8 and 0xcc are DHT, JPG and DAC.
+      0xc0 ..= 0xcf if marker != 0xc4 && marker != 0xc8 && marker != 0xcc => {
+        if frame.is_some() || data.len() < 6 {
+          return Err(());
+        }
+        frame = Some((marker, data));
+      }
+      _ => {}
+    }
+    pos += 2 + len;
+  }
+  let (marker, sof) = match frame {
+    None => return Err(()),
+    Some(frame) => frame,
+  };
+  let precision = sof[0] as usize;
+  let height = ((sof[1] as usize) << 8) | sof[2] as usize;
+  let width = ((sof[3] as usize) << 8) | sof[4] as usize;
+  let num_components = sof[5] as usize;
+  if sof.len() < 6 + 3 * num_components {
+    return Err(());
+  }
+  let component = |c: usize| {
+    let id = sof[6 + 3 * c];
+    let sampling = sof[7 + 3 * c];
+    (id, (sampling >> 4) as usize, (sampling & 0xf) as usize)
+  };
+  // Same as `default_decompress_parms` in jdapimin.c.
+  let color_space = match num_components {
+    1 => JpegColorSpace::Gray,
+    3 => match (saw_jfif, adobe_transform) {
+      (true, _) => JpegColorSpace::YCbCr,
+      (false, Some(0)) => JpegColorSpace::Rgb,
+      (false, Some(_)) => JpegColorSpace::YCbCr,
+      (false, None) => match (component(0).0, component(1).0, component(2).0) {
+        (b'R', b'G', b'B') => JpegColorSpace::Rgb,
+        _ => JpegColorSpace::YCbCr,
+      },
+    },
+    4 => match adobe_transform {
+      None | Some(0) => JpegColorSpace::Cmyk,
+      Some(_) => JpegColorSpace::Ycck,
+    },
+    _ => JpegColorSpace::Unknown,
+  };
+  // How many luma samples share a chroma sample, across and down:
+  // (1, 1) is 4:4:4, (2, 1) is 4:2:2 and (2, 2) is 4:2:0.
+  let subsampling = match num_components {
+    3 | 4 => {
+      let (_, h, v) = component(0);
+      let (_, ch, cv) = component(1);
+      if ch == 0 || cv == 0 || h % ch != 0 || v % cv != 0 {
+        (1, 1)
+      } else {
+        (h / ch, v / cv)
+      }
+    }
+    _ => (1, 1),
+  };
+  Ok(ImageInfo{
+    format:     ImageFormat::Jpeg,
+    width:      width,
+    height:     height,
+    bit_depth:  precision,
+    channels:   num_components,
+    has_alpha:  false,
+    // SOF2, SOF6, SOF10 and SOF14.
+    progressive:  (marker & 0x03) == 0x02,
+    has_icc:    has_icc,
+    exif_orientation: exif_rot,
+    jpeg_color_space: Some(color_space),
+    jpeg_subsampling: Some(subsampling),
+  })
+}
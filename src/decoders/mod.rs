@@ -1,2 +1,130 @@
+use decoders::jpeg::{NSJpegCtx};
+use decoders::png::{NSPngCtx};
+
+use std::cell::{RefCell};
+
 pub mod jpeg;
 pub mod png;
+
+/// Where an incremental decode stands after a `feed`.
+#[derive(Clone, Copy, PartialEq, Eq, Debug)]
+pub enum Progress {
+  /// The input so far has been decoded; the image needs more.
+  NeedMoreData,
+  /// The image is complete; any further input is ignored.
+  Done,
+}
+
+/// How JPEGs turn their DCT coefficients back into samples (libjpeg's
+/// `J_DCT_METHOD`).
+#[derive(Clone, Copy, PartialEq, Eq, Debug)]
+pub enum DctMethod {
+  /// Accurate integer IDCT.
+  IntSlow = 0,
+  /// Faster, less accurate integer IDCT; noticeably worse only at very high
+  /// quality settings.
+  IntFast = 1,
+  /// Floating point IDCT.
+  Float = 2,
+}
+
+/// Speed/quality trade-offs for a decode. The presets go from `fast`, for
+/// bulk preprocessing that can live with a small loss in PSNR, to
+/// `accurate` (the default).
+#[derive(Clone, Copy, PartialEq, Eq, Debug)]
+pub struct DecodeOptions {
+  /// Convert images with an embedded color profile to sRGB, when the decoder
+  /// has a color management context.
+  pub color_mgmt:       bool,
+  pub dct_method:       DctMethod,
+  /// Interpolate subsampled JPEG chroma rather than replicate it. Without
+  /// it, 4:2:2 and 4:2:0 images are upsampled and color converted in one
+  /// pass.
+  pub fancy_upsampling: bool,
+  /// Smooth over the missing AC coefficients of progressive JPEG passes
+  /// that are output before all the scans are in.
+  pub block_smoothing:  bool,
+}
+
+impl Default for DecodeOptions {
+  fn default() -> Self {
+    DecodeOptions::accurate()
+  }
+}
+
+impl DecodeOptions {
+  /// Fast integer IDCT, merged upsampling and no smoothing.
+  pub fn fast() -> DecodeOptions {
+    DecodeOptions{
+      color_mgmt:       true,
+      dct_method:       DctMethod::IntFast,
+      fancy_upsampling: false,
+      block_smoothing:  false,
+    }
+  }
+
+  /// Fast integer IDCT, with interpolated chroma and smoothing.
+  pub fn balanced() -> DecodeOptions {
+    DecodeOptions{
+      color_mgmt:       true,
+      dct_method:       DctMethod::IntFast,
+      fancy_upsampling: true,
+      block_smoothing:  true,
+    }
+  }
+
+  /// Accurate integer IDCT, with interpolated chroma and smoothing.
+  pub fn accurate() -> DecodeOptions {
+    DecodeOptions{
+      color_mgmt:       true,
+      dct_method:       DctMethod::IntSlow,
+      fancy_upsampling: true,
+      block_smoothing:  true,
+    }
+  }
+
+  pub fn with_color_mgmt(mut self, color_mgmt: bool) -> DecodeOptions {
+    self.color_mgmt = color_mgmt;
+    self
+  }
+}
+
+/// Most spare contexts of each format that a thread keeps.
+pub const DECODER_POOL_MAX_SPARE: usize = 4;
+
+thread_local!(static DECODER_POOL: RefCell<DecoderPool> = RefCell::new(DecoderPool{
+  jpeg: vec![],
+  png:  vec![],
+}));
+
+/// The decoder contexts that this thread's decoders have finished with.
+///
+/// Setting up a context (for JPEG, the libjpeg object with its source
+/// manager and saved-marker settings, plus the input and row buffers) costs
+/// about as much as decoding a small image, so a decoder takes a spare one
+/// from here on its first decode, resets it after every image, and puts it
+/// back when it is dropped. Up to `DECODER_POOL_MAX_SPARE` of each format
+/// are kept; the rest are freed, as are all of them when the thread exits.
+pub struct DecoderPool {
+  jpeg: Vec<NSJpegCtx>,
+  png:  Vec<NSPngCtx>,
+}
+
+impl DecoderPool {
+  /// Frees this thread's spare contexts.
+  pub fn clear() {
+    let _ = DECODER_POOL.try_with(|pool| {
+      let mut pool = pool.borrow_mut();
+      pool.jpeg.clear();
+      pool.png.clear();
+    });
+  }
+
+  /// The number of spare JPEG and PNG contexts that this thread holds.
+  pub fn len() -> (usize, usize) {
+    DECODER_POOL.try_with(|pool| {
+      let pool = pool.borrow();
+      (pool.jpeg.len(), pool.png.len())
+    }).unwrap_or((0, 0))
+  }
+}
@@ -1,41 +1,294 @@
 use ::*;
 use color::*;
+use decoders::{DECODER_POOL, DECODER_POOL_MAX_SPARE, DecodeOptions, Progress};
+use exif::{parse_exif_tiff};
 use ffi::gckimg::*;
 
+use std::marker::{PhantomData};
 use std::mem::{size_of, zeroed};
+use std::ptr::{null};
+use std::sync::{Arc};
+
+/// A PNG decoder context whose row buffers are reused for image after
+/// image; decoders get theirs from the thread's `DecoderPool`. The libpng
+/// structs themselves are created for each image.
+pub struct NSPngCtx {
+  ctx:  Box<NSPngDecoderCtx>,
+}
+
+// Only the decoder holding the context ever uses it, and libpng keeps no
+// per-thread state, so a decoder can move to another thread between images
+// (see `BatchDecoder`).
+unsafe impl Send for NSPngCtx {}
+
+impl Drop for NSPngCtx {
+  fn drop(&mut self) {
+    unsafe { gckimg_ns_png_cleanup(&mut *self.ctx as *mut _) };
+  }
+}
+
+impl NSPngCtx {
+  fn new() -> NSPngCtx {
+    assert_eq!(size_of::<NSPngDecoderCtx>(), unsafe { gckimg_ns_png_sizeof() });
+    NSPngCtx{
+      ctx:  Box::new(unsafe { zeroed() }),
+    }
+  }
+
+  fn take() -> NSPngCtx {
+    match DECODER_POOL.try_with(|pool| pool.borrow_mut().png.pop()) {
+      Ok(Some(ctx)) => ctx,
+      _ => NSPngCtx::new(),
+    }
+  }
+
+  fn recycle(self) {
+    // Once the pool is full (or gone, as the thread exits), the context is
+    // dropped here.
+    let _ = DECODER_POOL.try_with(move |pool| {
+      let mut pool = pool.borrow_mut();
+      if pool.png.len() < DECODER_POOL_MAX_SPARE {
+        pool.png.push(self);
+      }
+    });
+  }
+}
 
 pub struct NSPngDecoder {
-  ctx:  NSPngDecoderCtx,
+  ctx:  Option<NSPngCtx>,
+  cm:   Option<Arc<ColorMgmt>>,
+  final_pass_only:  bool,
+  target_size:  Option<(usize, usize)>,
+  opts:         DecodeOptions,
 }
 
 impl NSPngDecoder {
   pub fn new(color_mgmt: bool) -> NSPngDecoder {
-    NSPngDecoder{ctx: unsafe { zeroed() }}
+    NSPngDecoder::with_color_mgmt(match color_mgmt {
+      false => None,
+      true  => Some(ColorMgmt::shared()),
+    })
+  }
+
+  pub fn with_color_mgmt(cm: Option<Arc<ColorMgmt>>) -> NSPngDecoder {
+    NSPngDecoder{
+      ctx:  None,
+      cm:   cm,
+      final_pass_only:  true,
+      target_size:  None,
+      opts:         DecodeOptions::default(),
+    }
+  }
+
+  /// Whether interlaced PNGs are written out once, after all their passes
+  /// are combined (the default), rather than on every pass. The final image
+  /// is the same, so this only matters to writers that look at
+  /// intermediate rows.
+  pub fn with_final_pass_only(mut self, final_pass_only: bool) -> NSPngDecoder {
+    self.final_pass_only = final_pass_only;
+    self
+  }
+
+  /// Decode interlaced PNGs at the smallest scale 1/8, 1/4 or 1/2 whose
+  /// output is still at least `width` x `height`, by stopping after the
+  /// Adam7 pass that completes that grid. The writer sees the reduced size.
+  /// Non-interlaced PNGs are decoded at full size.
+  pub fn with_target_size(mut self, width: usize, height: usize) -> NSPngDecoder {
+    self.target_size = Some((width, height));
+    self
+  }
+
+  /// Whether to use the color management context for the images that
+  /// follow; the other options only apply to JPEGs.
+  pub fn with_options(mut self, opts: DecodeOptions) -> NSPngDecoder {
+    self.opts = opts;
+    self
+  }
+
+  /// Like `with_options`, for a decoder that is kept around between images.
+  pub fn set_options(&mut self, opts: DecodeOptions) {
+    self.opts = opts;
+  }
+
+  fn ctx_ptr(&mut self) -> *mut NSPngDecoderCtx {
+    &mut *self.ctx.as_mut().unwrap().ctx as *mut _
+  }
+
+  fn start(&mut self) -> *const ColorMgmtCtx {
+    // The context is fresh, or was reset after the last image.
+    if self.ctx.is_none() {
+      self.ctx = Some(NSPngCtx::take());
+    }
+    let ctx = self.ctx_ptr();
+    let color_mgmt = self.cm.is_some() && self.opts.color_mgmt;
+    let cm_ptr = match (color_mgmt, &self.cm) {
+      (true, &Some(ref cm)) => &cm.ctx as *const _,
+      _ => null(),
+    };
+    unsafe { gckimg_ns_png_init(
+        ctx,
+        color_mgmt as _) };
+    unsafe { gckimg_ns_png_set_final_pass_only(
+        ctx,
+        self.final_pass_only as _) };
+    if let Some((width, height)) = self.target_size {
+      unsafe { gckimg_ns_png_set_target_size(
+          ctx,
+          width as _, height as _) };
+    }
+    cm_ptr
   }
 
   pub fn decode<W>(&mut self, buf: &[u8], writer: &mut W) -> Result<(), ()>
   where W: ImageWriter + 'static {
-    self.ctx = unsafe { zeroed() };
-    assert_eq!(size_of::<NSPngDecoderCtx>(), unsafe { gckimg_ns_png_sizeof() });
-    COLOR_MGMT.with(|cm| {
-      let mut cm = cm.borrow_mut();
-      unsafe { gckimg_ns_png_init(
-          &mut self.ctx as *mut _,
-          // TODO: color mgmt option.
-          1) };
-      unsafe { gckimg_ns_png_decode(
-          &mut self.ctx as *mut _,
-          &mut cm.ctx as *mut _,
-          buf.as_ptr(), buf.len(),
-          writer as *mut W as *mut _,
-          <W as ImageWriter>::callbacks(),
-      ) };
-      unsafe { gckimg_ns_png_cleanup(
-          &mut self.ctx as *mut _) };
-    });
-    match self.ctx.errorcode {
+    let cm_ptr = self.start();
+    let ctx = self.ctx_ptr();
+    unsafe { gckimg_ns_png_decode(
+        ctx,
+        cm_ptr,
+        buf.as_ptr(), buf.len(),
+        writer as *mut W as *mut _,
+        <W as ImageWriter>::callbacks(),
+    ) };
+    let errorcode = unsafe { (*ctx).errorcode };
+    unsafe { gckimg_ns_png_reset(ctx) };
+    match errorcode {
+      0 => Ok(()),
+      _ => Err(()),
+    }
+  }
+
+  /// Start an incremental decode: pass the input to `feed` as it arrives,
+  /// then call `finish`. As with `decode`, a truncated image ends the
+  /// decode with the rows read so far, while a broken one fails.
+  pub fn begin<'a, W>(&'a mut self, writer: &'a mut W) -> NSPngStream<'a, W>
+  where W: ImageWriter + 'static {
+    let cm_ptr = self.start();
+    unsafe { gckimg_ns_png_begin(
+        self.ctx_ptr(),
+        cm_ptr,
+        writer as *mut W as *mut _,
+        <W as ImageWriter>::callbacks(),
+    ) };
+    NSPngStream{
+      dec:    self,
+      writer: PhantomData,
+    }
+  }
+}
+
+impl Drop for NSPngDecoder {
+  fn drop(&mut self) {
+    if let Some(ctx) = self.ctx.take() {
+      ctx.recycle();
+    }
+  }
+}
+
+/// An incremental decode started by `NSPngDecoder::begin`. Dropping it
+/// before `finish` abandons the decode.
+pub struct NSPngStream<'a, W: 'a> {
+  dec:    &'a mut NSPngDecoder,
+  writer: PhantomData<&'a mut W>,
+}
+
+impl<'a, W: 'a> NSPngStream<'a, W> {
+  /// Decode as far as `buf` and the input before it go. `buf` is not
+  /// needed after this returns. Fails once libpng finds the data broken.
+  pub fn feed(&mut self, buf: &[u8]) -> Result<Progress, ()> {
+    match unsafe { gckimg_ns_png_feed(
+        self.dec.ctx_ptr(),
+        buf.as_ptr(), buf.len()) } {
+      0 => Ok(Progress::NeedMoreData),
+      1 => Ok(Progress::Done),
+      _ => Err(()),
+    }
+  }
+
+  /// End the input, writing out what a truncated image has so far. Fails
+  /// if the data was broken or ended before the header.
+  pub fn finish(self) -> Result<(), ()> {
+    let ctx = self.dec.ctx_ptr();
+    unsafe { gckimg_ns_png_finish(ctx) };
+    match unsafe { (*ctx).errorcode } {
       0 => Ok(()),
       _ => Err(()),
     }
   }
 }
+
+impl<'a, W: 'a> Drop for NSPngStream<'a, W> {
+  fn drop(&mut self) {
+    unsafe { gckimg_ns_png_reset(self.dec.ctx_ptr()) };
+  }
+}
+
+/// Read a PNG's metadata from its chunks up to the first IDAT, without
+/// starting libpng.
+pub fn probe_png(buf: &[u8]) -> Result<ImageInfo, ()> {
+  fn be32(b: &[u8]) -> usize {
+    ((b[0] as usize) << 24) | ((b[1] as usize) << 16) | ((b[2] as usize) << 8) | b[3] as usize
+  }
+
+  if !buf.starts_with(&PNG_MAGICNUM) {
+    return Err(());
+  }
+  // IHDR is always the first chunk.
+  if buf.len() < 8 + 8 + 13 || &buf[12 .. 16] != b"IHDR" || be32(&buf[8 .. 12]) != 13 {
+    return Err(());
+  }
+  let ihdr = &buf[16 .. 29];
+  let width = be32(&ihdr[0 .. 4]);
+  let height = be32(&ihdr[4 .. 8]);
+  let bit_depth = ihdr[8] as usize;
+  let color_type = ihdr[9];
+  let interlaced = ihdr[12] != 0;
+  let channels = match color_type {
+    0 => 1,
+    2 => 3,
+    // Palette entries are RGB.
+    3 => 3,
+    4 => 2,
+    6 => 4,
+    _ => return Err(()),
+  };
+  let mut has_alpha = color_type == 4 || color_type == 6;
+  let mut has_icc = false;
+  let mut exif_rot = None;
+  // IHDR's length, type, data and CRC.
+  let mut pos = 8 + 25;
+  while pos + 8 <= buf.len() {
+    let len = be32(&buf[pos .. pos + 4]);
+    let ty = &buf[pos + 4 .. pos + 8];
+    if ty == b"IDAT" || ty == b"IEND" {
+      break;
+    }
+    if len > buf.len() - pos - 8 {
+      break;
+    }
+    let data = &buf[pos + 8 .. pos + 8 + len];
+    match ty {
+      b"tRNS" => has_alpha = true,
+      b"iCCP" => has_icc = true,
+      b"eXIf" if exif_rot.is_none() => {
+        // The chunk holds the TIFF data without the APP1 header.
+        exif_rot = parse_exif_tiff(data).ok();
+      }
+      _ => {}
+    }
+    pos += 8 + len + 4;
+  }
+  Ok(ImageInfo{
+    format:     ImageFormat::Png,
+    width:      width,
+    height:     height,
+    bit_depth:  bit_depth,
+    channels:   channels,
+    has_alpha:  has_alpha,
+    progressive:  interlaced,
+    has_icc:    has_icc,
+    exif_orientation: exif_rot,
+    jpeg_color_space: None,
+    jpeg_subsampling: None,
+  })
+}
@@ -6,44 +6,38 @@ use ffi::gckimg::*;
 
 use byteorder::*;
 
-use std::io::{Read, Seek, Cursor, SeekFrom};
+use std::io::{Seek, Cursor, SeekFrom};
 
 pub fn parse_exif(raw_exif: &[u8]) -> Result<i32, ()> {
-  // An APP1 segment larger than 64k violates the JPEG standard.
-  if raw_exif.len() > 64 * 1024 {
+  if !raw_exif.starts_with(b"Exif\0\0") {
     return Err(());
   }
+  parse_exif_tiff(&raw_exif[6 .. ])
+}
 
-  let mut cursor = Cursor::new(raw_exif);
-  let mut buf = vec![];
-
-  fn match_bytes(cursor: &mut Cursor<&[u8]>, s: &[u8], buf: &mut Vec<u8>) -> Result<(), ()> {
-    buf.clear();
-    for _ in 0 .. s.len() {
-      buf.push(cursor.read_u8().unwrap());
-    }
-    if &buf as &[u8] == s {
-      Ok(())
-    } else {
-      Err(())
-    }
-  }
-
-  if match_bytes(&mut cursor, b"Exif\0\0", &mut buf).is_err() {
+/// Like `parse_exif`, for the TIFF data that follows the "Exif\0\0" header
+/// (all that a PNG eXIf chunk holds).
+pub fn parse_exif_tiff(tiff: &[u8]) -> Result<i32, ()> {
+  // An APP1 segment larger than 64k violates the JPEG standard.
+  if tiff.len() + 6 > 64 * 1024 {
     return Err(());
   }
 
+  let mut cursor = Cursor::new(tiff);
+
   // Determine byte order.
-  if match_bytes(&mut cursor, b"MM\0*", &mut buf).is_ok() {
-    _parse_exif_part2::<BigEndian>(&mut cursor, buf)
-  } else if match_bytes(&mut cursor, b"II*\0", &mut buf).is_ok() {
-    _parse_exif_part2::<LittleEndian>(&mut cursor, buf)
+  if tiff.starts_with(b"MM\0*") {
+    cursor.set_position(4);
+    _parse_exif_part2::<BigEndian>(&mut cursor)
+  } else if tiff.starts_with(b"II*\0") {
+    cursor.set_position(4);
+    _parse_exif_part2::<LittleEndian>(&mut cursor)
   } else {
     Err(())
   }
 }
 
-fn _parse_exif_part2<E>(cursor: &mut Cursor<&[u8]>, mut buf: Vec<u8>) -> Result<i32, ()> where E: ByteOrder {
+fn _parse_exif_part2<E>(cursor: &mut Cursor<&[u8]>) -> Result<i32, ()> where E: ByteOrder {
   // Determine offset of the 0th IFD. (It shouldn't be greater than 64k, which
   // is the maximum size of the entry APP1 segment.)
   let ifd0_offset = match cursor.read_u32::<E>() {
@@ -54,11 +48,9 @@ fn _parse_exif_part2<E>(cursor: &mut Cursor<&[u8]>, mut buf: Vec<u8>) -> Result<
     return Err(());
   }
 
-  // The IFD offset is relative to the beginning of the TIFF header, which
-  // begins after the EXIF header, so we need to increase the offset
-  // appropriately.
-  let ifd0_offset_abs = ifd0_offset + 6;
-  match cursor.seek(SeekFrom::Start(ifd0_offset_abs as _)) {
+  // The IFD offset is relative to the beginning of the TIFF header, which is
+  // where the cursor starts.
+  match cursor.seek(SeekFrom::Start(ifd0_offset as _)) {
     Ok(_) => {}
     Err(_) => return Err(()),
   };
@@ -0,0 +1,125 @@
+#include "clut_cache.h"
+#include "qcms/qcms.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CLUT_FILE_MAGIC     "GCKCLUT1"
+#define CLUT_MAX_GRID_SIZE  255
+
+// The file is the header, then the profile bytes padded to a multiple of 4,
+// then the CLUT as native floats. Storing the whole profile means a hash
+// collision is a miss rather than a wrong transform.
+struct ClutFileHeader {
+  char magic[8];
+  uint32_t grid_size;
+  uint32_t float_size;
+  uint64_t profile_hash;
+  uint64_t profile_size;
+};
+
+static size_t _pad4(size_t n) {
+  return (n + 3) & ~(size_t)3;
+}
+
+static size_t _clut_bytes(size_t grid_size) {
+  return 3 * grid_size * grid_size * grid_size * sizeof(float);
+}
+
+static int _clut_path(char *path, size_t len, const char *dir, uint64_t hash, size_t profile_size) {
+  int n = snprintf(path, len, "%s/%016llx-%zu.clut", dir, (unsigned long long)hash, profile_size);
+  return n > 0 && (size_t)n < len;
+}
+
+qcms_transform *gckimg_clut_cache_load(const char *dir, uint64_t hash, const uint8_t *profile, size_t profile_size, qcms_data_type in_type) {
+  char path[4096];
+  if (!_clut_path(path, sizeof(path), dir, hash, profile_size)) {
+    return NULL;
+  }
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct ClutFileHeader)) {
+    close(fd);
+    return NULL;
+  }
+  size_t file_size = (size_t)st.st_size;
+  void *map = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return NULL;
+  }
+
+  const struct ClutFileHeader *header = map;
+  const uint8_t *body = (const uint8_t *)map + sizeof(struct ClutFileHeader);
+  size_t clut_offset = sizeof(struct ClutFileHeader) + _pad4(profile_size);
+  qcms_transform *transform = NULL;
+  if (memcmp(header->magic, CLUT_FILE_MAGIC, sizeof(header->magic)) == 0 &&
+      header->float_size == sizeof(float) &&
+      header->profile_hash == hash &&
+      header->profile_size == profile_size &&
+      header->grid_size >= 2 && header->grid_size <= CLUT_MAX_GRID_SIZE &&
+      file_size == clut_offset + _clut_bytes(header->grid_size) &&
+      memcmp(body, profile, profile_size) == 0)
+  {
+    // The transform keeps its own copy, so the mapping can go right away.
+    transform = qcms_transform_create_from_clut(
+        (const float *)((const uint8_t *)map + clut_offset),
+        (int)header->grid_size,
+        in_type);
+  }
+  munmap(map, file_size);
+  return transform;
+}
+
+void gckimg_clut_cache_store(const char *dir, uint64_t hash, const uint8_t *profile, size_t profile_size, qcms_transform *transform) {
+  int grid_size = 0;
+  const float *clut = qcms_transform_get_clut(transform, &grid_size);
+  if (clut == NULL || grid_size < 2 || grid_size > CLUT_MAX_GRID_SIZE) {
+    return;
+  }
+  char path[4096];
+  char tmp_path[4096 + 32];
+  if (!_clut_path(path, sizeof(path), dir, hash, profile_size)) {
+    return;
+  }
+  // Threads and processes sharing the directory may store the same CLUT at
+  // once, so each writes its own uniquely named file before the rename.
+  snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path);
+  int fd = mkstemp(tmp_path);
+  if (fd < 0) {
+    return;
+  }
+  FILE *file = fdopen(fd, "wb");
+  if (file == NULL) {
+    close(fd);
+    unlink(tmp_path);
+    return;
+  }
+  struct ClutFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CLUT_FILE_MAGIC, sizeof(header.magic));
+  header.grid_size = (uint32_t)grid_size;
+  header.float_size = sizeof(float);
+  header.profile_hash = hash;
+  header.profile_size = profile_size;
+  static const uint8_t zeros[4] = { 0, 0, 0, 0 };
+  size_t clut_bytes = _clut_bytes((size_t)grid_size);
+  int ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+           fwrite(profile, 1, profile_size, file) == profile_size &&
+           fwrite(zeros, 1, _pad4(profile_size) - profile_size, file) == _pad4(profile_size) - profile_size &&
+           fwrite(clut, 1, clut_bytes, file) == clut_bytes;
+  if (fclose(file) != 0) {
+    ok = 0;
+  }
+  if (!ok || rename(tmp_path, path) != 0) {
+    unlink(tmp_path);
+  }
+}
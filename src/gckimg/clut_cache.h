@@ -0,0 +1,18 @@
+#ifndef __GCKIMG_CLUT_CACHE_H__
+#define __GCKIMG_CLUT_CACHE_H__
+
+#include "qcms/qcms.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// On-disk cache of the CLUTs that qcms computes for LUT based (ICC v4)
+// input profiles, keyed by the embedded profile bytes. Files are written
+// whole and renamed into place, so several processes can share a directory.
+
+// Returns a new transform, or NULL on a miss.
+qcms_transform *gckimg_clut_cache_load(const char *dir, uint64_t hash, const uint8_t *profile, size_t profile_size, qcms_data_type in_type);
+// Does nothing unless `transform` interpolates a CLUT.
+void gckimg_clut_cache_store(const char *dir, uint64_t hash, const uint8_t *profile, size_t profile_size, qcms_transform *transform);
+
+#endif
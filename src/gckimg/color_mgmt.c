@@ -1,12 +1,375 @@
 #include "color_mgmt.h"
+#include "clut_cache.h"
 #include "qcms/qcms.h"
 
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CACHE_PROFILES    32
+#define CACHE_TRANSFORMS  64
+
+struct ProfileEntry {
+  uint64_t hash;
+  size_t size;
+  // Copy of the embedded profile bytes; NULL if the slot is empty.
+  uint8_t *data;
+  // May be NULL if the bytes did not parse, so bad profiles are not
+  // re-parsed for every image.
+  qcms_profile *profile;
+  // Memoized `qcms_profile_match` against the output profile; -1 if unknown.
+  int matches_output;
+  uint64_t last_use;
+};
+
+struct TransformEntry {
+  // Holds a reference, so the key cannot be freed and reused while cached.
+  qcms_profile *in_profile;
+  qcms_data_type in_type;
+  qcms_data_type out_type;
+  qcms_intent intent;
+  qcms_transform *transform;
+  uint64_t last_use;
+};
+
+struct ColorMgmtCache {
+  pthread_mutex_t lock;
+  uint64_t clock;
+  struct ProfileEntry profiles[CACHE_PROFILES];
+  struct TransformEntry transforms[CACHE_TRANSFORMS];
+};
+
+static pthread_once_t _srgb_profile_once = PTHREAD_ONCE_INIT;
+static qcms_profile *_srgb_profile = NULL;
+
+static void _init_srgb_profile(void) {
+  _srgb_profile = qcms_profile_sRGB();
+  if (_srgb_profile != NULL) {
+    // Precaching the output tables lets `qcms_transform_create` pick the
+    // SIMD precache kernels. After this the profile is never written to
+    // again, so it is safe to share across contexts and threads. The
+    // reference taken here is never dropped, so the profile (and its
+    // address, which the transform cache uses as a key) lives for the rest
+    // of the process.
+    qcms_profile_precache_output_transform(_srgb_profile);
+  }
+}
+
+qcms_profile *gckimg_color_mgmt_srgb_profile(void) {
+  pthread_once(&_srgb_profile_once, _init_srgb_profile);
+  return _srgb_profile;
+}
+
+static struct ColorMgmtCache *_cache_create(void) {
+  struct ColorMgmtCache *cache = calloc(1, sizeof(struct ColorMgmtCache));
+  if (cache == NULL) {
+    return NULL;
+  }
+  if (pthread_mutex_init(&cache->lock, NULL) != 0) {
+    free(cache);
+    return NULL;
+  }
+  return cache;
+}
+
+static void _cache_destroy(struct ColorMgmtCache *cache) {
+  size_t i;
+  for (i = 0; i < CACHE_TRANSFORMS; i++) {
+    struct TransformEntry *entry = &cache->transforms[i];
+    if (entry->transform != NULL) {
+      qcms_transform_release(entry->transform);
+      qcms_profile_release(entry->in_profile);
+    }
+  }
+  for (i = 0; i < CACHE_PROFILES; i++) {
+    struct ProfileEntry *entry = &cache->profiles[i];
+    if (entry->data != NULL) {
+      if (entry->profile != NULL) {
+        qcms_profile_release(entry->profile);
+      }
+      free(entry->data);
+    }
+  }
+  pthread_mutex_destroy(&cache->lock);
+  free(cache);
+}
+
+static uint64_t _hash_bytes(const uint8_t *data, size_t size) {
+  // FNV-1a.
+  uint64_t h = 0xcbf29ce484222325ULL;
+  size_t i;
+  for (i = 0; i < size; i++) {
+    h ^= data[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+// The following helpers must be called with the cache lock held.
+
+static struct ProfileEntry *_find_profile(struct ColorMgmtCache *cache, uint64_t hash, const void *mem, size_t size) {
+  size_t i;
+  for (i = 0; i < CACHE_PROFILES; i++) {
+    struct ProfileEntry *entry = &cache->profiles[i];
+    if (entry->data != NULL && entry->hash == hash && entry->size == size &&
+        memcmp(entry->data, mem, size) == 0) {
+      entry->last_use = ++cache->clock;
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+static struct ProfileEntry *_find_cached_profile(struct ColorMgmtCache *cache, qcms_profile *profile) {
+  size_t i;
+  for (i = 0; i < CACHE_PROFILES; i++) {
+    if (cache->profiles[i].data != NULL && cache->profiles[i].profile == profile) {
+      return &cache->profiles[i];
+    }
+  }
+  return NULL;
+}
+
+static struct TransformEntry *_find_transform(struct ColorMgmtCache *cache, qcms_profile *in, qcms_data_type in_type, qcms_data_type out_type, qcms_intent intent) {
+  size_t i;
+  for (i = 0; i < CACHE_TRANSFORMS; i++) {
+    struct TransformEntry *entry = &cache->transforms[i];
+    if (entry->transform != NULL && entry->in_profile == in &&
+        entry->in_type == in_type && entry->out_type == out_type &&
+        entry->intent == intent) {
+      entry->last_use = ++cache->clock;
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+static struct ProfileEntry *_evict_profile(struct ColorMgmtCache *cache) {
+  struct ProfileEntry *victim = &cache->profiles[0];
+  size_t i;
+  for (i = 0; i < CACHE_PROFILES; i++) {
+    struct ProfileEntry *entry = &cache->profiles[i];
+    if (entry->data == NULL) {
+      return entry;
+    }
+    if (entry->last_use < victim->last_use) {
+      victim = entry;
+    }
+  }
+  // Anyone still decoding with the evicted profile holds their own reference.
+  if (victim->profile != NULL) {
+    qcms_profile_release(victim->profile);
+  }
+  free(victim->data);
+  memset(victim, 0, sizeof(struct ProfileEntry));
+  return victim;
+}
+
+static struct TransformEntry *_evict_transform(struct ColorMgmtCache *cache) {
+  struct TransformEntry *victim = &cache->transforms[0];
+  size_t i;
+  for (i = 0; i < CACHE_TRANSFORMS; i++) {
+    struct TransformEntry *entry = &cache->transforms[i];
+    if (entry->transform == NULL) {
+      return entry;
+    }
+    if (entry->last_use < victim->last_use) {
+      victim = entry;
+    }
+  }
+  qcms_transform_release(victim->transform);
+  qcms_profile_release(victim->in_profile);
+  memset(victim, 0, sizeof(struct TransformEntry));
+  return victim;
+}
+
+static qcms_profile *_parse_profile(const struct ColorMgmtCtx *color_mgmt, const void *mem, size_t size) {
+  if (color_mgmt != NULL && color_mgmt->iccv4) {
+    return qcms_profile_from_memory_iccv4(mem, size);
+  }
+  return qcms_profile_from_memory(mem, size);
+}
+
+qcms_profile *gckimg_color_mgmt_profile_from_memory(const struct ColorMgmtCtx *color_mgmt, const void *mem, size_t size) {
+  if (color_mgmt == NULL || color_mgmt->cache == NULL || size == 0) {
+    return _parse_profile(color_mgmt, mem, size);
+  }
+  struct ColorMgmtCache *cache = color_mgmt->cache;
+  uint64_t hash = _hash_bytes(mem, size);
+  struct ProfileEntry *entry = NULL;
+  qcms_profile *profile = NULL;
+
+  pthread_mutex_lock(&cache->lock);
+  entry = _find_profile(cache, hash, mem, size);
+  if (entry != NULL) {
+    profile = entry->profile != NULL ? qcms_profile_reference(entry->profile) : NULL;
+    pthread_mutex_unlock(&cache->lock);
+    return profile;
+  }
+  pthread_mutex_unlock(&cache->lock);
+
+  // Parse outside the lock; if another thread got there first, use theirs.
+  profile = _parse_profile(color_mgmt, mem, size);
+  uint8_t *data = malloc(size);
+  if (data == NULL) {
+    return profile;
+  }
+  memcpy(data, mem, size);
+
+  pthread_mutex_lock(&cache->lock);
+  entry = _find_profile(cache, hash, mem, size);
+  if (entry != NULL) {
+    free(data);
+    if (profile != NULL) {
+      qcms_profile_release(profile);
+    }
+    profile = entry->profile != NULL ? qcms_profile_reference(entry->profile) : NULL;
+  } else {
+    entry = _evict_profile(cache);
+    entry->hash = hash;
+    entry->size = size;
+    entry->data = data;
+    entry->profile = profile != NULL ? qcms_profile_reference(profile) : NULL;
+    entry->matches_output = -1;
+    entry->last_use = ++cache->clock;
+  }
+  pthread_mutex_unlock(&cache->lock);
+  return profile;
+}
+
+qcms_transform *gckimg_color_mgmt_transform_create(const struct ColorMgmtCtx *color_mgmt, qcms_profile *in, qcms_data_type in_type, qcms_data_type out_type, qcms_intent intent) {
+  if (color_mgmt == NULL || color_mgmt->out_profile == NULL) {
+    return NULL;
+  }
+  struct ColorMgmtCache *cache = color_mgmt->cache;
+  if (cache == NULL) {
+    return qcms_transform_create(in, in_type, color_mgmt->out_profile, out_type, intent);
+  }
+  struct ProfileEntry *profile_entry = NULL;
+  struct TransformEntry *entry = NULL;
+  qcms_transform *transform = NULL;
+  uint64_t profile_hash = 0;
+  size_t profile_size = 0;
+  uint8_t *profile_data = NULL;
+
+  // Only profiles that came out of the profile cache (or the shared sRGB
+  // profile) are keyed by pointer; anything else could be freed and its
+  // address reused under us.
+  pthread_mutex_lock(&cache->lock);
+  profile_entry = _find_cached_profile(cache, in);
+  if (in != _srgb_profile && profile_entry == NULL) {
+    pthread_mutex_unlock(&cache->lock);
+    return qcms_transform_create(in, in_type, color_mgmt->out_profile, out_type, intent);
+  }
+  entry = _find_transform(cache, in, in_type, out_type, intent);
+  if (entry != NULL) {
+    transform = qcms_transform_reference(entry->transform);
+    pthread_mutex_unlock(&cache->lock);
+    return transform;
+  }
+  // CLUTs only come from LUT profiles, which are only used with iccv4. The
+  // on-disk key does not identify the output profile, so stick to sRGB.
+  if (color_mgmt->clut_cache_dir != NULL && color_mgmt->iccv4 &&
+      color_mgmt->out_profile == _srgb_profile && profile_entry != NULL) {
+    profile_data = malloc(profile_entry->size);
+    if (profile_data != NULL) {
+      memcpy(profile_data, profile_entry->data, profile_entry->size);
+      profile_hash = profile_entry->hash;
+      profile_size = profile_entry->size;
+    }
+  }
+  pthread_mutex_unlock(&cache->lock);
+
+  if (profile_data != NULL) {
+    transform = gckimg_clut_cache_load(color_mgmt->clut_cache_dir, profile_hash, profile_data, profile_size, in_type);
+  }
+  if (transform == NULL) {
+    transform = qcms_transform_create(in, in_type, color_mgmt->out_profile, out_type, intent);
+    if (transform != NULL && profile_data != NULL) {
+      gckimg_clut_cache_store(color_mgmt->clut_cache_dir, profile_hash, profile_data, profile_size, transform);
+    }
+  }
+  free(profile_data);
+  if (transform == NULL) {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&cache->lock);
+  entry = _find_transform(cache, in, in_type, out_type, intent);
+  if (entry != NULL) {
+    qcms_transform_release(transform);
+    transform = qcms_transform_reference(entry->transform);
+  } else {
+    entry = _evict_transform(cache);
+    entry->in_profile = qcms_profile_reference(in);
+    entry->in_type = in_type;
+    entry->out_type = out_type;
+    entry->intent = intent;
+    entry->transform = qcms_transform_reference(transform);
+    entry->last_use = ++cache->clock;
+  }
+  pthread_mutex_unlock(&cache->lock);
+  return transform;
+}
+
+int gckimg_color_mgmt_matches_output(const struct ColorMgmtCtx *color_mgmt, qcms_profile *in) {
+  if (color_mgmt == NULL || color_mgmt->out_profile == NULL) {
+    return 0;
+  }
+  struct ColorMgmtCache *cache = color_mgmt->cache;
+  struct ProfileEntry *entry = NULL;
+  int matches = -1;
+
+  if (cache != NULL) {
+    pthread_mutex_lock(&cache->lock);
+    entry = _find_cached_profile(cache, in);
+    if (entry != NULL) {
+      matches = entry->matches_output;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    if (matches >= 0) {
+      return matches;
+    }
+  }
+
+  matches = qcms_profile_match(in, color_mgmt->out_profile) ? 1 : 0;
+
+  if (cache != NULL) {
+    pthread_mutex_lock(&cache->lock);
+    entry = _find_cached_profile(cache, in);
+    if (entry != NULL) {
+      entry->matches_output = matches;
+    }
+    pthread_mutex_unlock(&cache->lock);
+  }
+  return matches;
+}
+
 void gckimg_color_mgmt_init_default(struct ColorMgmtCtx *color_mgmt) {
-  color_mgmt->out_profile = qcms_profile_sRGB();
+  color_mgmt->out_profile = gckimg_color_mgmt_srgb_profile();
+  if (color_mgmt->out_profile != NULL) {
+    qcms_profile_reference(color_mgmt->out_profile);
+  }
+  color_mgmt->cache = _cache_create();
+  color_mgmt->iccv4 = 0;
+  color_mgmt->clut_cache_dir = NULL;
+}
+
+void gckimg_color_mgmt_set_clut_cache_dir(struct ColorMgmtCtx *color_mgmt, const char *dir) {
+  free(color_mgmt->clut_cache_dir);
+  color_mgmt->clut_cache_dir = dir != NULL ? strdup(dir) : NULL;
 }
 
 void gckimg_color_mgmt_cleanup(struct ColorMgmtCtx *color_mgmt) {
+  free(color_mgmt->clut_cache_dir);
+  color_mgmt->clut_cache_dir = NULL;
+  if (color_mgmt->cache != NULL) {
+    _cache_destroy(color_mgmt->cache);
+    color_mgmt->cache = NULL;
+  }
   if (color_mgmt->out_profile != NULL) {
     qcms_profile_release(color_mgmt->out_profile);
   }
+  color_mgmt->out_profile = NULL;
 }
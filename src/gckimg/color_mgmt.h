@@ -3,11 +3,37 @@
 
 #include "qcms/qcms.h"
 
+#include <stddef.h>
+
+struct ColorMgmtCache;
+
 struct ColorMgmtCtx {
   qcms_profile *out_profile;
+  struct ColorMgmtCache *cache;
+  // Honor the A2B0/B2A0 LUTs of ICC v4 style profiles. Set before the
+  // context is first used for decoding.
+  int iccv4;
+  // Optional directory for the on-disk CLUT cache (see clut_cache.h).
+  char *clut_cache_dir;
 };
 
+// Shared, precached sRGB profile. The returned pointer is borrowed; take a
+// reference with `qcms_profile_reference` to hold on to it.
+qcms_profile *gckimg_color_mgmt_srgb_profile(void);
 void gckimg_color_mgmt_init_default(struct ColorMgmtCtx *color_mgmt);
 void gckimg_color_mgmt_cleanup(struct ColorMgmtCtx *color_mgmt);
+// Copies `dir`; NULL turns the on-disk CLUT cache off. Like `iccv4`, set
+// before the context is first used for decoding.
+void gckimg_color_mgmt_set_clut_cache_dir(struct ColorMgmtCtx *color_mgmt, const char *dir);
+
+// Both of these return a new reference, to be dropped with
+// `qcms_profile_release` / `qcms_transform_release`. `color_mgmt` may be NULL,
+// in which case nothing is cached.
+qcms_profile *gckimg_color_mgmt_profile_from_memory(const struct ColorMgmtCtx *color_mgmt, const void *mem, size_t size);
+qcms_transform *gckimg_color_mgmt_transform_create(const struct ColorMgmtCtx *color_mgmt, qcms_profile *in, qcms_data_type in_type, qcms_data_type out_type, qcms_intent intent);
+
+// Returns nonzero if `in` is equivalent to the output profile, so that the
+// transform can be skipped altogether.
+int gckimg_color_mgmt_matches_output(const struct ColorMgmtCtx *color_mgmt, qcms_profile *in);
 
 #endif
@@ -3,9 +3,77 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 struct ImageExifData;
 
+// Layouts a writer can ask for (`ImageWriterCallbacks::pixel_format`). In the
+// 4-byte layouts, X holds the alpha of images that have it and is 0xff
+// otherwise.
+enum ImagePixelFormat {
+  IMAGE_PIXEL_FORMAT_RGBX = 0,
+  IMAGE_PIXEL_FORMAT_BGRX,
+  IMAGE_PIXEL_FORMAT_XRGB,
+  IMAGE_PIXEL_FORMAT_XBGR,
+  IMAGE_PIXEL_FORMAT_RGB,
+};
+
+static inline size_t gckimg_pixel_format_bpp(int pixel_format) {
+  return pixel_format == IMAGE_PIXEL_FORMAT_RGB ? 3 : 4;
+}
+
+// Stores `width` RGBX pixels from `src` in `dst` in `pixel_format`. `dst`
+// may be `src`.
+static inline void gckimg_store_rgbx(const uint8_t *src, uint8_t *dst, size_t width, int pixel_format) {
+  size_t i;
+  switch (pixel_format) {
+    case IMAGE_PIXEL_FORMAT_BGRX:
+      for (i = 0; i < width; i++) {
+        const uint8_t r = src[4 * i], g = src[4 * i + 1], b = src[4 * i + 2], x = src[4 * i + 3];
+        dst[4 * i] = b; dst[4 * i + 1] = g; dst[4 * i + 2] = r; dst[4 * i + 3] = x;
+      }
+      break;
+    case IMAGE_PIXEL_FORMAT_XRGB:
+      for (i = 0; i < width; i++) {
+        const uint8_t r = src[4 * i], g = src[4 * i + 1], b = src[4 * i + 2], x = src[4 * i + 3];
+        dst[4 * i] = x; dst[4 * i + 1] = r; dst[4 * i + 2] = g; dst[4 * i + 3] = b;
+      }
+      break;
+    case IMAGE_PIXEL_FORMAT_XBGR:
+      for (i = 0; i < width; i++) {
+        const uint8_t r = src[4 * i], g = src[4 * i + 1], b = src[4 * i + 2], x = src[4 * i + 3];
+        dst[4 * i] = x; dst[4 * i + 1] = b; dst[4 * i + 2] = g; dst[4 * i + 3] = r;
+      }
+      break;
+    case IMAGE_PIXEL_FORMAT_RGB:
+      // Front to back, so packing in place is fine.
+      for (i = 0; i < width; i++) {
+        const uint8_t r = src[4 * i], g = src[4 * i + 1], b = src[4 * i + 2];
+        dst[3 * i] = r; dst[3 * i + 1] = g; dst[3 * i + 2] = b;
+      }
+      break;
+    default:
+      if (dst != src) {
+        memcpy(dst, src, 4 * width);
+      }
+      break;
+  }
+}
+
+// Stores `width` packed RGB pixels from `src` in `dst` in `pixel_format`,
+// with X set to 0xff. `dst` must not overlap `src`.
+static inline void gckimg_store_rgb(const uint8_t *src, uint8_t *dst, size_t width, int pixel_format) {
+  size_t i;
+  if (pixel_format == IMAGE_PIXEL_FORMAT_RGB) {
+    memcpy(dst, src, 3 * width);
+    return;
+  }
+  for (i = 0; i < width; i++) {
+    dst[4 * i] = src[3 * i]; dst[4 * i + 1] = src[3 * i + 1]; dst[4 * i + 2] = src[3 * i + 2]; dst[4 * i + 3] = 0xff;
+  }
+  gckimg_store_rgbx(dst, dst, width, pixel_format);
+}
+
 struct ImageWriterCallbacks {
   void (*init_size)(void *, size_t, size_t);
   //void (*write_row)(void *, size_t, const uint8_t *, size_t);
@@ -13,7 +81,20 @@ struct ImageWriterCallbacks {
   void (*write_row_grayx)(void *, size_t, const uint8_t *, size_t);
   void (*write_row_rgb)(void *, size_t, const uint8_t *, size_t);
   void (*write_row_rgbx)(void *, size_t, const uint8_t *, size_t);
+  // Optional. Like `write_row_rgbx`, for `num_rows` rows starting at
+  // `row_idx`, `stride` bytes apart:
+  // (writer, row_idx, num_rows, rows, stride, width).
+  void (*write_rows_rgbx)(void *, size_t, size_t, const uint8_t *, size_t, size_t);
+  // Optional. Returns the destination for a row, laid out in `pixel_format`,
+  // so the decoder can fill it in place instead of calling `write_row_rgbx`
+  // (or, for IMAGE_PIXEL_FORMAT_RGB, `write_row_rgb`). May be NULL, or
+  // return NULL.
+  uint8_t *(*get_row_buffer)(void *, size_t);
   int (*parse_exif)(void *, const uint8_t *, size_t);
+  // The `ImagePixelFormat` the writer stores. Color rows arrive in it:
+  // through `write_row_rgbx` and `write_rows_rgbx` for the 4-byte layouts,
+  // and through `write_row_rgb` for IMAGE_PIXEL_FORMAT_RGB.
+  int pixel_format;
 };
 
 #endif
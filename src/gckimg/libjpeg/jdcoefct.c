@@ -496,17 +496,23 @@ decompress_smooth_data (j_decompress_ptr cinfo, JSAMPIMAGE output_buf)
       if (first_row && block_row == 0)
         prev_block_row = buffer_ptr;
       else
-        prev_block_row = buffer[block_row-1];
+        prev_block_row = buffer[block_row-1] + cinfo->master->first_MCU_col[ci];
       if (last_row && block_row == block_rows-1)
         next_block_row = buffer_ptr;
       else
-        next_block_row = buffer[block_row+1];
+        next_block_row = buffer[block_row+1] + cinfo->master->first_MCU_col[ci];
       /* We fetch the surrounding DC values using a sliding-register approach.
        * Initialize all nine here so as to do the right thing on narrow pics.
        */
       DC1 = DC2 = DC3 = (int) prev_block_row[0][0];
       DC4 = DC5 = DC6 = (int) buffer_ptr[0][0];
       DC7 = DC8 = DC9 = (int) next_block_row[0][0];
+      /* With jpeg_crop_scanline(), the first block may have a left neighbor. */
+      if (cinfo->master->first_MCU_col[ci] > 0) {
+        DC1 = (int) prev_block_row[-1][0];
+        DC4 = (int) buffer_ptr[-1][0];
+        DC7 = (int) next_block_row[-1][0];
+      }
       output_col = 0;
       last_block_column = compptr->width_in_blocks - 1;
       for (block_num = cinfo->master->first_MCU_col[ci];
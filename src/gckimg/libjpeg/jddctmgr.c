@@ -120,6 +120,11 @@ start_pass (j_decompress_ptr cinfo)
       method = JDCT_ISLOW;      /* jidctred uses islow-style table */
       break;
     case 3:
+#if defined(__x86_64__)
+      if (jsimd_can_idct_3x3())
+        method_ptr = jsimd_idct_3x3;
+      else
+#endif
       method_ptr = jpeg_idct_3x3;
       method = JDCT_ISLOW;      /* jidctint uses islow-style table */
       break;
@@ -131,11 +136,16 @@ start_pass (j_decompress_ptr cinfo)
       method = JDCT_ISLOW;      /* jidctred uses islow-style table */
       break;
     case 5:
+#if defined(__x86_64__)
+      if (jsimd_can_idct_5x5())
+        method_ptr = jsimd_idct_5x5;
+      else
+#endif
       method_ptr = jpeg_idct_5x5;
       method = JDCT_ISLOW;      /* jidctint uses islow-style table */
       break;
     case 6:
-#if defined(__mips__)
+#if defined(__mips__) || defined(__x86_64__)
       if (jsimd_can_idct_6x6())
         method_ptr = jsimd_idct_6x6;
       else
@@ -144,6 +154,11 @@ start_pass (j_decompress_ptr cinfo)
       method = JDCT_ISLOW;      /* jidctint uses islow-style table */
       break;
     case 7:
+#if defined(__x86_64__)
+      if (jsimd_can_idct_7x7())
+        method_ptr = jsimd_idct_7x7;
+      else
+#endif
       method_ptr = jpeg_idct_7x7;
       method = JDCT_ISLOW;      /* jidctint uses islow-style table */
       break;
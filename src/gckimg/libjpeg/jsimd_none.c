@@ -304,18 +304,36 @@ jsimd_can_idct_2x2 (void)
   return 0;
 }
 
+GLOBAL(int)
+jsimd_can_idct_3x3 (void)
+{
+  return 0;
+}
+
 GLOBAL(int)
 jsimd_can_idct_4x4 (void)
 {
   return 0;
 }
 
+GLOBAL(int)
+jsimd_can_idct_5x5 (void)
+{
+  return 0;
+}
+
 GLOBAL(int)
 jsimd_can_idct_6x6 (void)
 {
   return 0;
 }
 
+GLOBAL(int)
+jsimd_can_idct_7x7 (void)
+{
+  return 0;
+}
+
 GLOBAL(int)
 jsimd_can_idct_12x12 (void)
 {
@@ -329,6 +347,13 @@ jsimd_idct_2x2 (j_decompress_ptr cinfo, jpeg_component_info *compptr,
 {
 }
 
+GLOBAL(void)
+jsimd_idct_3x3 (j_decompress_ptr cinfo, jpeg_component_info *compptr,
+                JCOEFPTR coef_block, JSAMPARRAY output_buf,
+                JDIMENSION output_col)
+{
+}
+
 GLOBAL(void)
 jsimd_idct_4x4 (j_decompress_ptr cinfo, jpeg_component_info *compptr,
                 JCOEFPTR coef_block, JSAMPARRAY output_buf,
@@ -336,6 +361,13 @@ jsimd_idct_4x4 (j_decompress_ptr cinfo, jpeg_component_info *compptr,
 {
 }
 
+GLOBAL(void)
+jsimd_idct_5x5 (j_decompress_ptr cinfo, jpeg_component_info *compptr,
+                JCOEFPTR coef_block, JSAMPARRAY output_buf,
+                JDIMENSION output_col)
+{
+}
+
 GLOBAL(void)
 jsimd_idct_6x6 (j_decompress_ptr cinfo, jpeg_component_info *compptr,
                 JCOEFPTR coef_block, JSAMPARRAY output_buf,
@@ -343,6 +375,13 @@ jsimd_idct_6x6 (j_decompress_ptr cinfo, jpeg_component_info *compptr,
 {
 }
 
+GLOBAL(void)
+jsimd_idct_7x7 (j_decompress_ptr cinfo, jpeg_component_info *compptr,
+                JCOEFPTR coef_block, JSAMPARRAY output_buf,
+                JDIMENSION output_col)
+{
+}
+
 GLOBAL(void)
 jsimd_idct_12x12 (j_decompress_ptr cinfo, jpeg_component_info *compptr,
                   JCOEFPTR coef_block, JSAMPARRAY output_buf,
@@ -35,22 +35,37 @@ EXTERN(void) jsimd_quantize_float (JCOEFPTR coef_block, FAST_FLOAT *divisors,
                                    FAST_FLOAT *workspace);
 
 EXTERN(int) jsimd_can_idct_2x2 (void);
+EXTERN(int) jsimd_can_idct_3x3 (void);
 EXTERN(int) jsimd_can_idct_4x4 (void);
+EXTERN(int) jsimd_can_idct_5x5 (void);
 EXTERN(int) jsimd_can_idct_6x6 (void);
+EXTERN(int) jsimd_can_idct_7x7 (void);
 EXTERN(int) jsimd_can_idct_12x12 (void);
 
 EXTERN(void) jsimd_idct_2x2 (j_decompress_ptr cinfo,
                              jpeg_component_info *compptr,
                              JCOEFPTR coef_block, JSAMPARRAY output_buf,
                              JDIMENSION output_col);
+EXTERN(void) jsimd_idct_3x3 (j_decompress_ptr cinfo,
+                             jpeg_component_info *compptr,
+                             JCOEFPTR coef_block, JSAMPARRAY output_buf,
+                             JDIMENSION output_col);
 EXTERN(void) jsimd_idct_4x4 (j_decompress_ptr cinfo,
                              jpeg_component_info *compptr,
                              JCOEFPTR coef_block, JSAMPARRAY output_buf,
                              JDIMENSION output_col);
+EXTERN(void) jsimd_idct_5x5 (j_decompress_ptr cinfo,
+                             jpeg_component_info *compptr,
+                             JCOEFPTR coef_block, JSAMPARRAY output_buf,
+                             JDIMENSION output_col);
 EXTERN(void) jsimd_idct_6x6 (j_decompress_ptr cinfo,
                              jpeg_component_info *compptr,
                              JCOEFPTR coef_block, JSAMPARRAY output_buf,
                              JDIMENSION output_col);
+EXTERN(void) jsimd_idct_7x7 (j_decompress_ptr cinfo,
+                             jpeg_component_info *compptr,
+                             JCOEFPTR coef_block, JSAMPARRAY output_buf,
+                             JDIMENSION output_col);
 EXTERN(void) jsimd_idct_12x12 (j_decompress_ptr cinfo,
                                jpeg_component_info *compptr,
                                JCOEFPTR coef_block, JSAMPARRAY output_buf,
@@ -0,0 +1,426 @@
+/*
+ * AVX2 optimizations for libjpeg-turbo
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+/* SCALED INTEGER INVERSE DCT (3x3, 5x5, 6x6, 7x7)
+ *
+ * These are vectorized versions of jpeg_idct_3x3() ... jpeg_idct_7x7() in
+ * jidctint.c.  Each pass runs the 1-D kernel of the C code on eight 32-bit
+ * lanes at once (pass 1 over the columns, pass 2 over the rows of the
+ * transposed work array), with the same constants and the same order of
+ * operations.  For coefficients that come from 8-bit samples, none of the
+ * intermediate results exceed 32 bits, so the output is identical to that of
+ * the C code.  AVX2 is needed for the 32-bit multiplies.  The 3x3 IDCT uses
+ * four lanes instead (see below).
+ */
+
+#define JPEG_INTERNALS
+#include "../jinclude.h"
+#include "../jpeglib.h"
+#include "../jsimd.h"
+#include "../jdct.h"
+#include "jsimd.h"
+
+#include <immintrin.h>
+
+
+#define CONST_BITS  13
+#define PASS1_BITS  2
+
+/* Rounding and descaling of the two passes */
+#define PASS1_FUDGE  (1 << (CONST_BITS - PASS1_BITS - 1))
+#define PASS1_SHIFT  (CONST_BITS - PASS1_BITS)
+#define PASS2_FUDGE  ((1 << (PASS1_BITS + 2)) << CONST_BITS)
+#define PASS2_SHIFT  (CONST_BITS + PASS1_BITS + 3)
+
+#define AVX2_TARGET  __attribute__((target("avx2")))
+#define AVX2_INLINE  static inline __attribute__((always_inline)) AVX2_TARGET
+
+#define ADD(a, b)       _mm256_add_epi32(a, b)
+#define SUB(a, b)       _mm256_sub_epi32(a, b)
+#define SHL(a, n)       _mm256_slli_epi32(a, n)
+#define SRA(a, n)       _mm256_srai_epi32(a, n)
+#define MULTIPLY(a, c)  _mm256_mullo_epi32(a, _mm256_set1_epi32(c))
+
+
+/* Dequantize the first n rows of the coefficient block into data[0 .. n-1]
+ * and clear the rest.  (The loops in this file are written out, so that the
+ * whole block stays in registers.) */
+
+AVX2_INLINE __m256i
+dequantize_row (JCOEFPTR coef_block, ISLOW_MULT_TYPE *quantptr, int row,
+                int n)
+{
+  __m256i coef, quant;
+
+  if (row >= n)
+    return _mm256_setzero_si256();
+  coef = _mm256_cvtepi16_epi32(
+    _mm_loadu_si128((__m128i *)(coef_block + DCTSIZE * row)));
+  quant = _mm256_cvtepi16_epi32(
+    _mm_loadu_si128((__m128i *)(quantptr + DCTSIZE * row)));
+  return _mm256_mullo_epi32(coef, quant);
+}
+
+AVX2_INLINE void
+dequantize (__m256i *data, JCOEFPTR coef_block, ISLOW_MULT_TYPE *quantptr,
+            int n)
+{
+  data[0] = dequantize_row(coef_block, quantptr, 0, n);
+  data[1] = dequantize_row(coef_block, quantptr, 1, n);
+  data[2] = dequantize_row(coef_block, quantptr, 2, n);
+  data[3] = dequantize_row(coef_block, quantptr, 3, n);
+  data[4] = dequantize_row(coef_block, quantptr, 4, n);
+  data[5] = dequantize_row(coef_block, quantptr, 5, n);
+  data[6] = dequantize_row(coef_block, quantptr, 6, n);
+  data[7] = dequantize_row(coef_block, quantptr, 7, n);
+}
+
+
+AVX2_INLINE void
+transpose_8x8 (__m256i *data)
+{
+  __m256i t0, t1, t2, t3, t4, t5, t6, t7;
+  __m256i u0, u1, u2, u3, u4, u5, u6, u7;
+
+  t0 = _mm256_unpacklo_epi32(data[0], data[1]);
+  t1 = _mm256_unpackhi_epi32(data[0], data[1]);
+  t2 = _mm256_unpacklo_epi32(data[2], data[3]);
+  t3 = _mm256_unpackhi_epi32(data[2], data[3]);
+  t4 = _mm256_unpacklo_epi32(data[4], data[5]);
+  t5 = _mm256_unpackhi_epi32(data[4], data[5]);
+  t6 = _mm256_unpacklo_epi32(data[6], data[7]);
+  t7 = _mm256_unpackhi_epi32(data[6], data[7]);
+
+  u0 = _mm256_unpacklo_epi64(t0, t2);
+  u1 = _mm256_unpackhi_epi64(t0, t2);
+  u2 = _mm256_unpacklo_epi64(t1, t3);
+  u3 = _mm256_unpackhi_epi64(t1, t3);
+  u4 = _mm256_unpacklo_epi64(t4, t6);
+  u5 = _mm256_unpackhi_epi64(t4, t6);
+  u6 = _mm256_unpacklo_epi64(t5, t7);
+  u7 = _mm256_unpackhi_epi64(t5, t7);
+
+  data[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+  data[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+  data[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+  data[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+  data[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+  data[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+  data[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+  data[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+}
+
+
+/* Store the first n samples of a row packed into an integer */
+
+AVX2_INLINE void
+store_row (JSAMPROW outptr, long long row, int n)
+{
+  MEMCOPY(outptr, &row, n);
+}
+
+
+/* Range-limit the descaled pass 2 output (one output column per vector) and
+ * store the n x n block.  This is range_limit[x & RANGE_MASK] in jidctint.c:
+ * the low 10 bits are taken as a signed sample offset from CENTERJSAMPLE,
+ * which is then clamped to 0 .. MAXJSAMPLE. */
+
+AVX2_INLINE void
+store_samples (__m256i *data, JSAMPARRAY output_buf, JDIMENSION output_col,
+               int n)
+{
+  const __m256i center = _mm256_set1_epi32(CENTERJSAMPLE);
+  __m256i p01, p23, p45, p67, rows0123, rows4567;
+
+  /* Only the first n (5 or more) columns are stored, and column i only
+   * depends on data[i]. */
+  data[0] = ADD(SRA(SHL(data[0], 22), 22), center);
+  data[1] = ADD(SRA(SHL(data[1], 22), 22), center);
+  data[2] = ADD(SRA(SHL(data[2], 22), 22), center);
+  data[3] = ADD(SRA(SHL(data[3], 22), 22), center);
+  data[4] = ADD(SRA(SHL(data[4], 22), 22), center);
+  if (n > 5)
+    data[5] = ADD(SRA(SHL(data[5], 22), 22), center);
+  if (n > 6)
+    data[6] = ADD(SRA(SHL(data[6], 22), 22), center);
+  transpose_8x8(data);
+
+  p01 = _mm256_permute4x64_epi64(_mm256_packs_epi32(data[0], data[1]), 0xD8);
+  p23 = _mm256_permute4x64_epi64(_mm256_packs_epi32(data[2], data[3]), 0xD8);
+  p45 = _mm256_permute4x64_epi64(_mm256_packs_epi32(data[4], data[5]), 0xD8);
+  p67 = _mm256_permute4x64_epi64(_mm256_packs_epi32(data[6], data[7]), 0xD8);
+  rows0123 = _mm256_permute4x64_epi64(_mm256_packus_epi16(p01, p23), 0xD8);
+  rows4567 = _mm256_permute4x64_epi64(_mm256_packus_epi16(p45, p67), 0xD8);
+
+  store_row(output_buf[0] + output_col, _mm256_extract_epi64(rows0123, 0), n);
+  store_row(output_buf[1] + output_col, _mm256_extract_epi64(rows0123, 1), n);
+  store_row(output_buf[2] + output_col, _mm256_extract_epi64(rows0123, 2), n);
+  store_row(output_buf[3] + output_col, _mm256_extract_epi64(rows0123, 3), n);
+  store_row(output_buf[4] + output_col, _mm256_extract_epi64(rows4567, 0), n);
+  if (n > 5)
+    store_row(output_buf[5] + output_col, _mm256_extract_epi64(rows4567, 1), n);
+  if (n > 6)
+    store_row(output_buf[6] + output_col, _mm256_extract_epi64(rows4567, 2), n);
+}
+
+
+/* 1-D kernels.  The inputs are data[0 .. n-1], the outputs replace them. */
+
+AVX2_INLINE void
+idct_7 (__m256i *data, int fudge, int shift)
+{
+  __m256i tmp0, tmp1, tmp2, tmp10, tmp11, tmp12, tmp13;
+  __m256i z1, z2, z3;
+
+  /* Even part */
+
+  tmp13 = ADD(SHL(data[0], CONST_BITS), _mm256_set1_epi32(fudge));
+
+  z1 = data[2];
+  z2 = data[4];
+  z3 = data[6];
+
+  tmp10 = MULTIPLY(SUB(z2, z3), FIX(0.881747734));
+  tmp12 = MULTIPLY(SUB(z1, z2), FIX(0.314692123));
+  tmp11 = SUB(ADD(ADD(tmp10, tmp12), tmp13), MULTIPLY(z2, FIX(1.841218003)));
+  tmp0 = ADD(z1, z3);
+  z2 = SUB(z2, tmp0);
+  tmp0 = ADD(MULTIPLY(tmp0, FIX(1.274162392)), tmp13);
+  tmp10 = ADD(tmp10, SUB(tmp0, MULTIPLY(z3, FIX(0.077722536))));
+  tmp12 = ADD(tmp12, SUB(tmp0, MULTIPLY(z1, FIX(2.470602249))));
+  tmp13 = ADD(tmp13, MULTIPLY(z2, FIX(1.414213562)));
+
+  /* Odd part */
+
+  z1 = data[1];
+  z2 = data[3];
+  z3 = data[5];
+
+  tmp1 = MULTIPLY(ADD(z1, z2), FIX(0.935414347));
+  tmp2 = MULTIPLY(SUB(z1, z2), FIX(0.170262339));
+  tmp0 = SUB(tmp1, tmp2);
+  tmp1 = ADD(tmp1, tmp2);
+  tmp2 = MULTIPLY(ADD(z2, z3), - FIX(1.378756276));
+  tmp1 = ADD(tmp1, tmp2);
+  z2 = MULTIPLY(ADD(z1, z3), FIX(0.613604268));
+  tmp0 = ADD(tmp0, z2);
+  tmp2 = ADD(tmp2, ADD(z2, MULTIPLY(z3, FIX(1.870828693))));
+
+  /* Final output stage */
+
+  data[0] = SRA(ADD(tmp10, tmp0), shift);
+  data[6] = SRA(SUB(tmp10, tmp0), shift);
+  data[1] = SRA(ADD(tmp11, tmp1), shift);
+  data[5] = SRA(SUB(tmp11, tmp1), shift);
+  data[2] = SRA(ADD(tmp12, tmp2), shift);
+  data[4] = SRA(SUB(tmp12, tmp2), shift);
+  data[3] = SRA(tmp13, shift);
+}
+
+AVX2_INLINE void
+idct_6 (__m256i *data, int fudge, int shift)
+{
+  __m256i tmp0, tmp1, tmp2, tmp10, tmp11, tmp12;
+  __m256i z1, z2, z3;
+
+  /* Even part */
+
+  tmp0 = ADD(SHL(data[0], CONST_BITS), _mm256_set1_epi32(fudge));
+  tmp2 = data[4];
+  tmp10 = MULTIPLY(tmp2, FIX(0.707106781));
+  tmp1 = ADD(tmp0, tmp10);
+  tmp11 = SUB(SUB(tmp0, tmp10), tmp10);
+  tmp10 = data[2];
+  tmp0 = MULTIPLY(tmp10, FIX(1.224744871));
+  tmp10 = ADD(tmp1, tmp0);
+  tmp12 = SUB(tmp1, tmp0);
+
+  /* Odd part */
+
+  z1 = data[1];
+  z2 = data[3];
+  z3 = data[5];
+  tmp1 = MULTIPLY(ADD(z1, z3), FIX(0.366025404));
+  tmp0 = ADD(tmp1, SHL(ADD(z1, z2), CONST_BITS));
+  tmp2 = ADD(tmp1, SHL(SUB(z3, z2), CONST_BITS));
+  tmp1 = SUB(SUB(z1, z2), z3);
+
+  /* Final output stage */
+
+  data[0] = SRA(ADD(tmp10, tmp0), shift);
+  data[5] = SRA(SUB(tmp10, tmp0), shift);
+  if (shift == PASS1_SHIFT) {
+    /* Pass 1 descales tmp11 on its own and only scales up tmp1. */
+    tmp11 = SRA(tmp11, shift);
+    tmp1 = SHL(tmp1, PASS1_BITS);
+    data[1] = ADD(tmp11, tmp1);
+    data[4] = SUB(tmp11, tmp1);
+  } else {
+    tmp1 = SHL(tmp1, CONST_BITS);
+    data[1] = SRA(ADD(tmp11, tmp1), shift);
+    data[4] = SRA(SUB(tmp11, tmp1), shift);
+  }
+  data[2] = SRA(ADD(tmp12, tmp2), shift);
+  data[3] = SRA(SUB(tmp12, tmp2), shift);
+}
+
+AVX2_INLINE void
+idct_5 (__m256i *data, int fudge, int shift)
+{
+  __m256i tmp0, tmp1, tmp10, tmp11, tmp12;
+  __m256i z1, z2, z3;
+
+  /* Even part */
+
+  tmp12 = ADD(SHL(data[0], CONST_BITS), _mm256_set1_epi32(fudge));
+  tmp0 = data[2];
+  tmp1 = data[4];
+  z1 = MULTIPLY(ADD(tmp0, tmp1), FIX(0.790569415));
+  z2 = MULTIPLY(SUB(tmp0, tmp1), FIX(0.353553391));
+  z3 = ADD(tmp12, z2);
+  tmp10 = ADD(z3, z1);
+  tmp11 = SUB(z3, z1);
+  tmp12 = SUB(tmp12, SHL(z2, 2));
+
+  /* Odd part */
+
+  z2 = data[1];
+  z3 = data[3];
+
+  z1 = MULTIPLY(ADD(z2, z3), FIX(0.831253876));
+  tmp0 = ADD(z1, MULTIPLY(z2, FIX(0.513743148)));
+  tmp1 = SUB(z1, MULTIPLY(z3, FIX(2.176250899)));
+
+  /* Final output stage */
+
+  data[0] = SRA(ADD(tmp10, tmp0), shift);
+  data[4] = SRA(SUB(tmp10, tmp0), shift);
+  data[1] = SRA(ADD(tmp11, tmp1), shift);
+  data[3] = SRA(SUB(tmp11, tmp1), shift);
+  data[2] = SRA(tmp12, shift);
+}
+
+#define DEFINE_IDCT_AVX2(n) \
+GLOBAL(void) AVX2_TARGET \
+jsimd_idct_##n##x##n##_avx2 (void *dct_table, JCOEFPTR coef_block, \
+                             JSAMPARRAY output_buf, JDIMENSION output_col) \
+{ \
+  __m256i data[DCTSIZE]; \
+  \
+  dequantize(data, coef_block, (ISLOW_MULT_TYPE *) dct_table, n); \
+  idct_##n(data, PASS1_FUDGE, PASS1_SHIFT); \
+  transpose_8x8(data); \
+  idct_##n(data, PASS2_FUDGE, PASS2_SHIFT); \
+  store_samples(data, output_buf, output_col, n); \
+}
+
+DEFINE_IDCT_AVX2(5)
+DEFINE_IDCT_AVX2(6)
+DEFINE_IDCT_AVX2(7)
+
+
+/* The 3x3 IDCT only has 3 columns to work on, so it uses 4 lanes, which
+ * saves most of the cost of the transposes. */
+
+AVX2_INLINE void
+transpose_4x4 (__m128i *data)
+{
+  __m128i t0, t1, t2, t3;
+
+  t0 = _mm_unpacklo_epi32(data[0], data[1]);
+  t1 = _mm_unpackhi_epi32(data[0], data[1]);
+  t2 = _mm_unpacklo_epi32(data[2], data[3]);
+  t3 = _mm_unpackhi_epi32(data[2], data[3]);
+
+  data[0] = _mm_unpacklo_epi64(t0, t2);
+  data[1] = _mm_unpackhi_epi64(t0, t2);
+  data[2] = _mm_unpacklo_epi64(t1, t3);
+  data[3] = _mm_unpackhi_epi64(t1, t3);
+}
+
+AVX2_INLINE __m128i
+dequantize_row_4 (JCOEFPTR coef_block, ISLOW_MULT_TYPE *quantptr, int row)
+{
+  __m128i coef = _mm_cvtepi16_epi32(
+    _mm_loadl_epi64((__m128i *)(coef_block + DCTSIZE * row)));
+  __m128i quant = _mm_cvtepi16_epi32(
+    _mm_loadl_epi64((__m128i *)(quantptr + DCTSIZE * row)));
+
+  return _mm_mullo_epi32(coef, quant);
+}
+
+AVX2_INLINE void
+idct_3 (__m128i *data, int fudge, int shift)
+{
+  __m128i tmp0, tmp2, tmp10, tmp12;
+
+  /* Even part */
+
+  tmp0 = _mm_add_epi32(_mm_slli_epi32(data[0], CONST_BITS),
+                       _mm_set1_epi32(fudge));
+  tmp2 = data[2];
+  tmp12 = _mm_mullo_epi32(tmp2, _mm_set1_epi32(FIX(0.707106781)));
+  tmp10 = _mm_add_epi32(tmp0, tmp12);
+  tmp2 = _mm_sub_epi32(_mm_sub_epi32(tmp0, tmp12), tmp12);
+
+  /* Odd part */
+
+  tmp12 = data[1];
+  tmp0 = _mm_mullo_epi32(tmp12, _mm_set1_epi32(FIX(1.224744871)));
+
+  /* Final output stage */
+
+  data[0] = _mm_srai_epi32(_mm_add_epi32(tmp10, tmp0), shift);
+  data[2] = _mm_srai_epi32(_mm_sub_epi32(tmp10, tmp0), shift);
+  data[1] = _mm_srai_epi32(tmp2, shift);
+}
+
+GLOBAL(void) AVX2_TARGET
+jsimd_idct_3x3_avx2 (void *dct_table, JCOEFPTR coef_block,
+                     JSAMPARRAY output_buf, JDIMENSION output_col)
+{
+  ISLOW_MULT_TYPE *quantptr = (ISLOW_MULT_TYPE *) dct_table;
+  const __m128i center = _mm_set1_epi32(CENTERJSAMPLE);
+  __m128i data[4], rows;
+
+  data[0] = dequantize_row_4(coef_block, quantptr, 0);
+  data[1] = dequantize_row_4(coef_block, quantptr, 1);
+  data[2] = dequantize_row_4(coef_block, quantptr, 2);
+  data[3] = _mm_setzero_si128();
+
+  idct_3(data, PASS1_FUDGE, PASS1_SHIFT);
+  transpose_4x4(data);
+  idct_3(data, PASS2_FUDGE, PASS2_SHIFT);
+
+  /* Range limit as in store_samples() */
+  data[0] = _mm_add_epi32(_mm_srai_epi32(_mm_slli_epi32(data[0], 22), 22),
+                          center);
+  data[1] = _mm_add_epi32(_mm_srai_epi32(_mm_slli_epi32(data[1], 22), 22),
+                          center);
+  data[2] = _mm_add_epi32(_mm_srai_epi32(_mm_slli_epi32(data[2], 22), 22),
+                          center);
+  transpose_4x4(data);
+  rows = _mm_packus_epi16(_mm_packs_epi32(data[0], data[1]),
+                          _mm_packs_epi32(data[2], data[3]));
+
+  store_row(output_buf[0] + output_col, _mm_extract_epi32(rows, 0), 3);
+  store_row(output_buf[1] + output_col, _mm_extract_epi32(rows, 1), 3);
+  store_row(output_buf[2] + output_col, _mm_extract_epi32(rows, 2), 3);
+}
@@ -12,9 +12,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 // NOTE: Include jpeg headers after others.
 #include "jpeglib.h"
+#include "jpegint.h"
 #include "jerror.h"
 #include "iccjpeg.h"
 #include "ns_jpeg_decoder.h"
@@ -29,13 +33,17 @@
 
 #define MAX_JPEG_MARKER_LENGTH  (((uint32_t)1 << 16) - 1)
 
-static qcms_profile *_jpeg_get_icc_profile(struct jpeg_decompress_struct *info) {
+// Rows read from libjpeg per call on the RGBX path; covers an iMCU row of
+// 2x2 subsampled images.
+#define JPEG_MAX_BATCH_ROWS     16
+
+static qcms_profile *_jpeg_get_icc_profile(struct jpeg_decompress_struct *info, const struct ColorMgmtCtx *cm) {
   JOCTET *profilebuf;
   uint32_t profileLength;
   qcms_profile *profile = NULL;
 
   if (read_icc_profile(info, &profilebuf, &profileLength)) {
-    profile = qcms_profile_from_memory(profilebuf, profileLength);
+    profile = gckimg_color_mgmt_profile_from_memory(cm, profilebuf, profileLength);
     free(profilebuf);
   }
 
@@ -86,6 +94,143 @@ static void _cmyk_convert_rgb(JSAMPROW row, JDIMENSION width) {
   }
 }
 
+///*************** Fused YCbCr -> color managed RGBX ***********************
+/// Replaces libjpeg's color deconverter for ICC tagged YCbCr images. Each
+/// row is converted in chunks small enough to stay in L1, and every chunk
+/// goes through the qcms transform before moving on, so the intermediate
+/// RGB never makes it out to memory (libjpeg's SIMD converter writes it with
+/// non-temporal stores, which the transform then has to read back).
+/// The YCbCr -> RGB arithmetic is libjpeg's (jdcolor.c), bit for bit.
+
+#define YCC_CMS_CHUNK         256
+
+#define YCC_SCALEBITS         16
+#define YCC_ONE_HALF          ((int32_t)1 << (YCC_SCALEBITS - 1))
+#define YCC_FIX_1_40200       91881
+#define YCC_FIX_1_77200       116130
+#define YCC_FIX_0_71414       46802
+#define YCC_FIX_0_34414       22554
+
+static inline uint8_t _ycc_clamp(int v) {
+  return v < 0 ? 0 : v > 255 ? 255 : (uint8_t)v;
+}
+
+static void _ycc_to_rgbx(
+    const JSAMPLE *y_row, const JSAMPLE *cb_row, const JSAMPLE *cr_row,
+    uint8_t *out, JDIMENSION width)
+{
+  JDIMENSION i = 0;
+#ifdef __SSE2__
+  // 8 pixels at a time. The products are done with pmaddwd so they are
+  // exact in 32 bits; the coefficients that do not fit in 16 bits are split
+  // across the two halves of each pair.
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i bias = _mm_set1_epi16(128);
+  const __m128i half = _mm_set1_epi32(YCC_ONE_HALF);
+  const __m128i alpha = _mm_set1_epi8((char)0xff);
+  // 4x * 22970 + x * 1 = x * FIX(1.40200)
+  const __m128i k_r = _mm_set_epi16(1, 22970, 1, 22970, 1, 22970, 1, 22970);
+  // 4x * 29032 + x * 2 = x * FIX(1.77200)
+  const __m128i k_b = _mm_set_epi16(2, 29032, 2, 29032, 2, 29032, 2, 29032);
+  // cb * -FIX(0.34414) + 2cr * -(FIX(0.71414) / 2)
+  const __m128i k_g = _mm_set_epi16(
+      -(YCC_FIX_0_71414 / 2), -YCC_FIX_0_34414, -(YCC_FIX_0_71414 / 2), -YCC_FIX_0_34414,
+      -(YCC_FIX_0_71414 / 2), -YCC_FIX_0_34414, -(YCC_FIX_0_71414 / 2), -YCC_FIX_0_34414);
+
+  for (; i + 8 <= width; i += 8) {
+    __m128i y  = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(y_row + i)), zero);
+    __m128i cb = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(cb_row + i)), zero), bias);
+    __m128i cr = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(cr_row + i)), zero), bias);
+    __m128i cb4 = _mm_slli_epi16(cb, 2);
+    __m128i cr4 = _mm_slli_epi16(cr, 2);
+    __m128i cr2 = _mm_slli_epi16(cr, 1);
+
+#define YCC_TERM(a, b, k) \
+    _mm_packs_epi32( \
+        _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(a, b), k), half), YCC_SCALEBITS), \
+        _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(a, b), k), half), YCC_SCALEBITS))
+
+    __m128i r = _mm_add_epi16(y, YCC_TERM(cr4, cr, k_r));
+    __m128i g = _mm_add_epi16(y, YCC_TERM(cb, cr2, k_g));
+    __m128i b = _mm_add_epi16(y, YCC_TERM(cb4, cb, k_b));
+
+#undef YCC_TERM
+
+    __m128i rg = _mm_unpacklo_epi8(_mm_packus_epi16(r, r), _mm_packus_epi16(g, g));
+    __m128i bx = _mm_unpacklo_epi8(_mm_packus_epi16(b, b), alpha);
+    _mm_storeu_si128((__m128i *)(out + 4 * i), _mm_unpacklo_epi16(rg, bx));
+    _mm_storeu_si128((__m128i *)(out + 4 * i + 16), _mm_unpackhi_epi16(rg, bx));
+  }
+#endif
+  for (; i < width; i++) {
+    int y  = y_row[i];
+    int cb = (int)cb_row[i] - 128;
+    int cr = (int)cr_row[i] - 128;
+    out[4 * i + 0] = _ycc_clamp(y + ((YCC_FIX_1_40200 * cr + YCC_ONE_HALF) >> YCC_SCALEBITS));
+    out[4 * i + 1] = _ycc_clamp(y + ((-YCC_FIX_0_34414 * cb - YCC_FIX_0_71414 * cr + YCC_ONE_HALF) >> YCC_SCALEBITS));
+    out[4 * i + 2] = _ycc_clamp(y + ((YCC_FIX_1_77200 * cb + YCC_ONE_HALF) >> YCC_SCALEBITS));
+    out[4 * i + 3] = 0xff;
+  }
+}
+
+METHODDEF(void) _ycc_cms_convert(
+    j_decompress_ptr cinfo,
+    JSAMPIMAGE input_buf, JDIMENSION input_row,
+    JSAMPARRAY output_buf, int num_rows)
+{
+  struct NSJpegDecoderCtx *ctx = (struct NSJpegDecoderCtx *)cinfo->client_data;
+  JDIMENSION width = cinfo->output_width;
+  uint8_t chunk[4 * YCC_CMS_CHUNK];
+
+  while (--num_rows >= 0) {
+    const JSAMPLE *y_row = input_buf[0][input_row];
+    const JSAMPLE *cb_row = input_buf[1][input_row];
+    const JSAMPLE *cr_row = input_buf[2][input_row];
+    JSAMPROW out_row = *output_buf++;
+    input_row++;
+    for (JDIMENSION x = 0; x < width; x += YCC_CMS_CHUNK) {
+      JDIMENSION n = width - x < YCC_CMS_CHUNK ? width - x : YCC_CMS_CHUNK;
+      _ycc_to_rgbx(y_row + x, cb_row + x, cr_row + x, chunk, n);
+      if (ctx->callbacks.pixel_format == IMAGE_PIXEL_FORMAT_RGBX) {
+        qcms_transform_data(ctx->transform, chunk, out_row + 4 * x, n);
+      } else {
+        // qcms only writes RGBX; reorder on the way out.
+        qcms_transform_data(ctx->transform, chunk, chunk, n);
+        gckimg_store_rgbx(chunk, out_row + 4 * x, n, ctx->callbacks.pixel_format);
+      }
+    }
+  }
+}
+
+/// Whether color managed RGB output can be decoded as RGBX and transformed
+/// as QCMS_DATA_RGBA_8: the pad byte has to sit where qcms keeps alpha.
+static int _rgbx_cms_supported(void) {
+  return MOZ_JCS_EXT_NATIVE_ENDIAN_RGBX == JCS_EXT_RGBX;
+}
+
+/// The libjpeg color space that outputs rows in `pixel_format`.
+static J_COLOR_SPACE _ns_jpeg_out_color_space(int pixel_format) {
+  switch (pixel_format) {
+    case IMAGE_PIXEL_FORMAT_BGRX:
+      return JCS_EXT_BGRX;
+    case IMAGE_PIXEL_FORMAT_XRGB:
+      return JCS_EXT_XRGB;
+    case IMAGE_PIXEL_FORMAT_XBGR:
+      return JCS_EXT_XBGR;
+    case IMAGE_PIXEL_FORMAT_RGB:
+      return JCS_EXT_RGB;
+    default:
+      return MOZ_JCS_EXT_NATIVE_ENDIAN_RGBX;
+  }
+}
+
+/// Whether `_ycc_cms_convert` can stand in for libjpeg's conversion.
+static int _ycc_cms_supported(const struct jpeg_decompress_struct *info) {
+  return info->jpeg_color_space == JCS_YCbCr &&
+         info->num_components == 3 &&
+         _rgbx_cms_supported();
+}
+
 METHODDEF(void) my_error_exit(j_common_ptr cinfo) {
   // TODO
   (void)cinfo;
@@ -239,6 +384,103 @@ METHODDEF(void) term_source(j_decompress_ptr jd) {
   (void)jd;
 }
 
+static uint64_t _ns_jpeg_scaled_size(uint32_t size, unsigned int scale_num) {
+  // Matches `jpeg_calc_output_dimensions` for a scale of `scale_num`/8.
+  return ((uint64_t)size * scale_num + 7) / 8;
+}
+
+static void _ns_jpeg_choose_scale(struct NSJpegDecoderCtx *ctx) {
+  if (ctx->target_width == 0 && ctx->target_height == 0) {
+    return;
+  }
+  // The IDCT does the downscaling, so an N/8 decode does a fraction of the
+  // work of a full one.
+  for (unsigned int scale_num = 1; scale_num < 8; scale_num++) {
+    if (_ns_jpeg_scaled_size(ctx->info.image_width, scale_num) >= ctx->target_width &&
+        _ns_jpeg_scaled_size(ctx->info.image_height, scale_num) >= ctx->target_height) {
+      ctx->info.scale_num = scale_num;
+      ctx->info.scale_denom = 8;
+      return;
+    }
+  }
+}
+
+// Called after `jpeg_start_decompress`: restricts libjpeg to the iMCU columns
+// that cover the region and skips the rows above it.
+static void _ns_jpeg_start_region(struct NSJpegDecoderCtx *ctx) {
+  // Fancy upsampling treats the first and last column that libjpeg outputs
+  // as the edges of the image, so ask for one more pixel on either side of
+  // the window (where there is one) to get the same pixels as a full decode.
+  JDIMENSION left = ctx->region_x > 0 ? ctx->region_x - 1 : 0;
+  JDIMENSION right = ctx->region_x + ctx->region_width;
+  if (right < ctx->info.output_width) {
+    right++;
+  }
+  JDIMENSION xoffset = left;
+  JDIMENSION width = right - left;
+
+  jpeg_crop_scanline(&ctx->info, &xoffset, &width);
+  ctx->crop_x = ctx->region_x - xoffset;
+  ctx->crop_y = ctx->region_y;
+  // `jpeg_skip_scanlines` can't suspend, so with input still to come
+  // `_ns_jpeg_output_scanlines` reads the rows above the window instead.
+  if (ctx->whole_input) {
+    jpeg_skip_scanlines(&ctx->info, ctx->crop_y);
+  }
+}
+
+// Returns how many scans of `buf` are within the limits set by
+// `gckimg_ns_jpeg_set_scan_limit` (at least 1), or 0 if there are none. The
+// scans are found by walking the markers: entropy-coded data escapes its
+// 0xFF bytes, so a scan ends at the first marker after it other than RSTn.
+static uint32_t _ns_jpeg_count_scan_limit(const struct NSJpegDecoderCtx *ctx, const uint8_t *buf, size_t len) {
+  uint32_t scans = 0;
+  size_t pos = 2;  // After SOI.
+
+  if (ctx->max_scans == 0 && ctx->max_bytes == 0 && !ctx->dc_scans_only) {
+    return 0;
+  }
+  while (pos + 4 <= len && buf[pos] == 0xFF) {
+    uint8_t marker = buf[pos + 1];
+    if (marker == 0xFF) {
+      // Fill byte.
+      pos++;
+      continue;
+    }
+    if (marker == JPEG_EOI) {
+      break;
+    }
+    if (marker == 0x01 || (marker >= JPEG_RST0 && marker <= JPEG_RST0 + 7)) {
+      pos += 2;
+      continue;
+    }
+    size_t segment_len = ((size_t)buf[pos + 2] << 8) | buf[pos + 3];
+    if (marker != 0xDA) {  // SOS
+      pos += 2 + segment_len;
+      continue;
+    }
+    // Ss follows the scan's component selectors and table numbers.
+    size_t ss_pos = pos + 5 + 2UL * (pos + 4 < len ? buf[pos + 4] : 0);
+    if (ctx->dc_scans_only && ss_pos < len && buf[ss_pos] != 0) {
+      break;
+    }
+    pos += 2 + segment_len;
+    while (pos + 1 < len &&
+           !(buf[pos] == 0xFF && buf[pos + 1] != 0 &&
+             (buf[pos + 1] < JPEG_RST0 || buf[pos + 1] > JPEG_RST0 + 7))) {
+      pos++;
+    }
+    if (ctx->max_bytes != 0 && pos > ctx->max_bytes) {
+      break;
+    }
+    scans++;
+    if (scans == ctx->max_scans) {
+      break;
+    }
+  }
+  return scans > 0 ? scans : 1;
+}
+
 static int _ns_jpeg_read_orientation_from_exif(struct NSJpegDecoderCtx *ctx) {
   jpeg_saved_marker_ptr marker;
 
@@ -265,27 +507,144 @@ static int _ns_jpeg_read_orientation_from_exif(struct NSJpegDecoderCtx *ctx) {
   return (ctx->callbacks.parse_exif)(ctx->writer, marker->data, marker->data_length);
 }
 
+// Whether libjpeg outputs rows that `_ns_jpeg_output_rows` handles: in the
+// writer's layout, or RGBX for `transform`.
+static int _ns_jpeg_batched_rows(const struct NSJpegDecoderCtx *ctx) {
+  return ctx->info.out_color_space >= JCS_EXT_RGB &&
+         ctx->info.out_color_space <= JCS_EXT_ARGB;
+}
+
+// Reads up to `JPEG_MAX_BATCH_ROWS` rows and hands them to the writer in its
+// `pixel_format`. Returns 1 if libjpeg suspended before all of them were
+// read.
+static int _ns_jpeg_output_rows(struct NSJpegDecoderCtx *ctx) {
+  // Pixels per row for the writer, and per row that libjpeg outputs; they
+  // differ for a region decode (`crop_x`).
+  const JDIMENSION width = ctx->width;
+  const JDIMENSION row_width = ctx->info.output_width;
+  // Bytes per pixel that libjpeg outputs, and that the writer stores.
+  const size_t in_bpp = ctx->info.out_color_components;
+  const int pixel_format = ctx->callbacks.pixel_format;
+  const size_t out_bpp = gckimg_pixel_format_bpp(pixel_format);
+  const size_t stride = in_bpp * row_width;
+  const size_t x_offset = in_bpp * ctx->crop_x;
+  const JDIMENSION first_row = ctx->info.output_scanline - ctx->crop_y;
+  JDIMENSION num_rows = ctx->height - first_row;
+  JDIMENSION done_rows = 0;
+  // Rows handed to libjpeg, and where the finished rows end up.
+  JSAMPROW read_rows[JPEG_MAX_BATCH_ROWS];
+  uint8_t *dest_rows[JPEG_MAX_BATCH_ROWS];
+  // Unless libjpeg applies the transform itself (`ycc_cms`), transform
+  // the visible pixels from `input_buf` (RGBX) into the destination.
+  // Otherwise libjpeg already outputs the writer's layout.
+  int transform_rows = ctx->transform != NULL && !ctx->ycc_cms;
+  int in_place = ctx->callbacks.get_row_buffer != NULL &&
+                 (transform_rows || row_width == width);
+
+  if (num_rows > JPEG_MAX_BATCH_ROWS) {
+    num_rows = JPEG_MAX_BATCH_ROWS;
+  }
+  assert(NULL != ctx->input_buf);
+  assert(NULL != ctx->output_buf);
+  assert(transform_rows || in_bpp == out_bpp);
+
+  // Decode straight into the writer's rows if it hands all of them out.
+  for (JDIMENSION i = 0; i < num_rows && in_place; i++) {
+    dest_rows[i] = ctx->callbacks.get_row_buffer(ctx->writer, first_row + i);
+    in_place = dest_rows[i] != NULL;
+  }
+  for (JDIMENSION i = 0; i < num_rows; i++) {
+    if (!in_place) {
+      dest_rows[i] = ctx->output_buf + i * stride;
+    }
+    read_rows[i] = transform_rows ? ctx->input_buf + i * stride : dest_rows[i];
+  }
+
+  // Special case: scanlines will be directly converted into packed ARGB
+  while (done_rows < num_rows) {
+    JDIMENSION n = jpeg_read_scanlines(&ctx->info, read_rows + done_rows, num_rows - done_rows);
+    if (n == 0) {
+      break; // suspend
+    }
+    done_rows += n;
+  }
+
+  if (transform_rows) {
+    if (pixel_format != IMAGE_PIXEL_FORMAT_RGBX) {
+      // qcms only writes RGBX, so transform in place and store the result
+      // in the writer's layout.
+      for (JDIMENSION i = 0; i < done_rows; i++) {
+        qcms_transform_data(ctx->transform, read_rows[i] + x_offset, read_rows[i] + x_offset, width);
+        gckimg_store_rgbx(read_rows[i] + x_offset, dest_rows[i], width, pixel_format);
+      }
+    } else if (in_place || row_width != width) {
+      for (JDIMENSION i = 0; i < done_rows; i++) {
+        qcms_transform_data(ctx->transform, read_rows[i] + x_offset, dest_rows[i], width);
+      }
+    } else {
+      // The batch is contiguous in both buffers.
+      qcms_transform_data(ctx->transform, ctx->input_buf, ctx->output_buf, (size_t)width * done_rows);
+    }
+  }
+  if (!in_place && done_rows > 0) {
+    // Transformed rows start at the window; the others still have the
+    // cropped pixels in front.
+    const uint8_t *rows = ctx->output_buf + (transform_rows ? 0 : x_offset);
+    if (out_bpp == 3) {
+      for (JDIMENSION i = 0; i < done_rows; i++) {
+        ctx->callbacks.write_row_rgb(ctx->writer, first_row + i, rows + i * stride, width);
+      }
+    } else if (ctx->callbacks.write_rows_rgbx != NULL) {
+      ctx->callbacks.write_rows_rgbx(ctx->writer, first_row, done_rows, rows, stride, width);
+    } else {
+      for (JDIMENSION i = 0; i < done_rows; i++) {
+        ctx->callbacks.write_row_rgbx(ctx->writer, first_row + i, rows + i * stride, width);
+      }
+    }
+  }
+
+  return done_rows < num_rows;
+}
+
+// Hands a row of packed RGB, as the CMYK and RGB_8 transform paths below
+// produce, to the writer in its `pixel_format`. `scratch` has room for a
+// row of RGBX and doesn't overlap `rgb`.
+static void _ns_jpeg_write_rgb_row(struct NSJpegDecoderCtx *ctx, JDIMENSION row_idx, const uint8_t *rgb, uint8_t *scratch) {
+  const int pixel_format = ctx->callbacks.pixel_format;
+  uint8_t *dest = NULL;
+  if (ctx->callbacks.get_row_buffer != NULL) {
+    dest = ctx->callbacks.get_row_buffer(ctx->writer, row_idx);
+  }
+  if (dest != NULL) {
+    gckimg_store_rgb(rgb, dest, ctx->width, pixel_format);
+  } else if (pixel_format == IMAGE_PIXEL_FORMAT_RGB) {
+    ctx->callbacks.write_row_rgb(ctx->writer, row_idx, rgb, ctx->width);
+  } else {
+    gckimg_store_rgb(rgb, scratch, ctx->width, pixel_format);
+    ctx->callbacks.write_row_rgbx(ctx->writer, row_idx, scratch, ctx->width);
+  }
+}
+
 static int _ns_jpeg_output_scanlines(struct NSJpegDecoderCtx *ctx) {
   int suspend = 0;
+  // Bytes per pixel of the rows libjpeg outputs on the path below.
+  const size_t in_bpp = ctx->info.output_components;
+
+  // Rows above a region that weren't skipped (see `_ns_jpeg_start_region`).
+  while (ctx->info.output_scanline < ctx->crop_y) {
+    JSAMPROW row = ctx->input_buf;
+    if (jpeg_read_scanlines(&ctx->info, &row, 1) != 1) {
+      return 1; // suspend
+    }
+  }
 
-  while (ctx->info.output_scanline < ctx->info.output_height) {
-    if (ctx->transform == NULL && ctx->info.out_color_space == MOZ_JCS_EXT_NATIVE_ENDIAN_RGBX) {
-      uint8_t *image_row = ctx->output_buf;
-      assert(NULL != image_row);
-
-      // Special case: scanline will be directly converted into packed ARGB
-      if (jpeg_read_scanlines(&ctx->info, (JSAMPARRAY)&image_row, 1) != 1) {
-        fprintf(stderr, "WARNING: gckimg: _ns_jpeg_output_scanlines: suspend I/O (285)\n");
-        suspend = 1; // suspend
+  while (ctx->info.output_scanline < ctx->crop_y + ctx->height) {
+    if (_ns_jpeg_batched_rows(ctx)) {
+      suspend = _ns_jpeg_output_rows(ctx);
+      if (suspend) {
         break;
       }
-      assert(ctx->info.output_scanline >= 1);
-      ctx->callbacks.write_row_rgbx(
-          ctx->writer,
-          ctx->info.output_scanline - 1,
-          image_row,
-          ctx->info.output_width);
-      continue; // all done for this row!
+      continue; // all done for these rows!
     }
 
     uint8_t *image_row = ctx->input_buf;
@@ -300,7 +659,6 @@ static int _ns_jpeg_output_scanlines(struct NSJpegDecoderCtx *ctx) {
 
     // Request one scanline.  Returns 0 or 1 scanlines.
     if (jpeg_read_scanlines(&ctx->info, &image_row, 1) != 1) {
-      fprintf(stderr, "WARNING: gckimg: _ns_jpeg_output_scanlines: suspend I/O (302)\n");
       suspend = 1; // suspend
       break;
     }
@@ -312,7 +670,7 @@ static int _ns_jpeg_output_scanlines(struct NSJpegDecoderCtx *ctx) {
         // to the 3byte RGB byte pixels at 'end' of row
         sample_row += ctx->info.output_width;
       }*/
-      qcms_transform_data(ctx->transform, image_row, sample_row, ctx->info.output_width);
+      qcms_transform_data(ctx->transform, image_row + in_bpp * ctx->crop_x, sample_row, ctx->width);
       /*if (ctx->info.out_color_space == JCS_CMYK) {
         // Move 3byte RGB data to end of row
         memmove(sample_row + ctx->info.output_width,
@@ -328,16 +686,18 @@ static int _ns_jpeg_output_scanlines(struct NSJpegDecoderCtx *ctx) {
         // Would be better to have platform CMSenabled transformation
         // from CMYK to (A)RGB...
         _cmyk_convert_rgb((JSAMPROW)image_row, ctx->info.output_width);
-        sample_row = image_row + ctx->info.output_width;
+        sample_row = image_row + ctx->info.output_width + 3 * ctx->crop_x;
       }
     }
 
-    assert(ctx->info.output_scanline >= 1);
-    ctx->callbacks.write_row_rgb(
-        ctx->writer,
-        ctx->info.output_scanline - 1,
+    // The transform writes `output_buf` and the CMYK conversion
+    // `input_buf`; the other one is free for the writer's layout.
+    assert(ctx->info.output_scanline >= ctx->crop_y + 1);
+    _ns_jpeg_write_rgb_row(
+        ctx,
+        ctx->info.output_scanline - 1 - ctx->crop_y,
         sample_row,
-        ctx->info.output_width);
+        ctx->transform ? ctx->input_buf : ctx->output_buf);
 
     /*// counter for while() loops below
     uint32_t idx = ctx->info.output_width;
@@ -377,6 +737,10 @@ size_t gckimg_ns_jpeg_sizeof(void) {
 void gckimg_ns_jpeg_init(struct NSJpegDecoderCtx *ctx, int color_mgmt) {
   ctx->color_mgmt = color_mgmt;
   ctx->reading = 1;
+  ctx->final_pass_only = 1;
+  ctx->dct_method = JDCT_ISLOW;
+  ctx->fancy_upsampling = 1;
+  ctx->block_smoothing = 1;
 
   ctx->info.client_data = ctx;
 
@@ -422,16 +786,35 @@ void gckimg_ns_jpeg_init(struct NSJpegDecoderCtx *ctx, int color_mgmt) {
   }
 }
 
-void gckimg_ns_jpeg_cleanup(struct NSJpegDecoderCtx *ctx) {
-  // Step 8: release JPEG decompression object.
-  ctx->info.src = NULL;
-  jpeg_destroy_decompress(&ctx->info);
+void gckimg_ns_jpeg_set_target_size(struct NSJpegDecoderCtx *ctx, uint32_t width, uint32_t height) {
+  ctx->target_width = width;
+  ctx->target_height = height;
+}
 
-  if (ctx->back_buffer != NULL) {
-    free(ctx->back_buffer);
-    ctx->back_buffer = NULL;
-  }
+void gckimg_ns_jpeg_set_region(struct NSJpegDecoderCtx *ctx, uint32_t x, uint32_t y, uint32_t width, uint32_t height) {
+  ctx->region_x = x;
+  ctx->region_y = y;
+  ctx->region_width = width;
+  ctx->region_height = height;
+}
+
+void gckimg_ns_jpeg_set_final_pass_only(struct NSJpegDecoderCtx *ctx, int final_pass_only) {
+  ctx->final_pass_only = final_pass_only;
+}
+
+void gckimg_ns_jpeg_set_scan_limit(struct NSJpegDecoderCtx *ctx, uint32_t max_scans, size_t max_bytes, int dc_scans_only) {
+  ctx->max_scans = max_scans;
+  ctx->max_bytes = max_bytes;
+  ctx->dc_scans_only = dc_scans_only;
+}
 
+void gckimg_ns_jpeg_set_quality(struct NSJpegDecoderCtx *ctx, int dct_method, int fancy_upsampling, int block_smoothing) {
+  ctx->dct_method = dct_method;
+  ctx->fancy_upsampling = fancy_upsampling;
+  ctx->block_smoothing = block_smoothing;
+}
+
+static void _ns_jpeg_release_transform(struct NSJpegDecoderCtx *ctx) {
   if (ctx->transform != NULL) {
     qcms_transform_release(ctx->transform);
   }
@@ -440,6 +823,19 @@ void gckimg_ns_jpeg_cleanup(struct NSJpegDecoderCtx *ctx) {
   }
   ctx->transform = NULL;
   ctx->in_profile = NULL;
+}
+
+void gckimg_ns_jpeg_cleanup(struct NSJpegDecoderCtx *ctx) {
+  // Step 8: release JPEG decompression object.
+  ctx->info.src = NULL;
+  jpeg_destroy_decompress(&ctx->info);
+
+  if (ctx->back_buffer != NULL) {
+    free(ctx->back_buffer);
+    ctx->back_buffer = NULL;
+  }
+
+  _ns_jpeg_release_transform(ctx);
 
   if (ctx->input_buf != NULL) {
     free(ctx->input_buf);
@@ -449,39 +845,63 @@ void gckimg_ns_jpeg_cleanup(struct NSJpegDecoderCtx *ctx) {
     free(ctx->output_buf);
     ctx->output_buf = NULL;
   }
+  ctx->scratch_size = 0;
 }
 
-void gckimg_ns_jpeg_decode(
-    struct NSJpegDecoderCtx *ctx,
-    struct ColorMgmtCtx *cm,
-    const uint8_t *buf, size_t buf_len,
-    void *writer, struct ImageWriterCallbacks callbacks)
-{
-  ctx->cm = cm;
-  ctx->writer = writer;
-  ctx->callbacks = callbacks;
-
-  ctx->segment = (const JOCTET *)(buf);
-  ctx->segment_len = buf_len;
+void gckimg_ns_jpeg_reset(struct NSJpegDecoderCtx *ctx) {
+  // Frees the image's pools (markers, coefficient buffers, ...) and returns
+  // libjpeg to its state before `jpeg_read_header`; saved-marker settings
+  // live in the permanent pool and survive.
+  jpeg_abort_decompress(&ctx->info);
+  _ns_jpeg_release_transform(ctx);
+
+  ctx->source.next_input_byte = NULL;
+  ctx->source.bytes_in_buffer = 0;
+  ctx->segment = NULL;
+  ctx->segment_len = 0;
+  ctx->back_buffer_len = 0;
+  ctx->back_buffer_unread_len = 0;
+  ctx->bytes_to_skip = 0;
+  ctx->reading = 1;
+  ctx->profile = NULL;
+  ctx->profile_len = 0;
+  ctx->width = 0;
+  ctx->height = 0;
+  ctx->ycc_cms = 0;
+  ctx->state = NS_JPEG_HEADER;
+  ctx->errorcode = 0;
+  ctx->target_width = 0;
+  ctx->target_height = 0;
+  ctx->region_x = 0;
+  ctx->region_y = 0;
+  ctx->region_width = 0;
+  ctx->region_height = 0;
+  ctx->crop_x = 0;
+  ctx->crop_y = 0;
+  ctx->whole_input = 0;
+  ctx->final_pass_only = 1;
+  ctx->max_scans = 0;
+  ctx->max_bytes = 0;
+  ctx->dc_scans_only = 0;
+  ctx->scan_limit = 0;
+  ctx->dct_method = JDCT_ISLOW;
+  ctx->fancy_upsampling = 1;
+  ctx->block_smoothing = 1;
+  ctx->cm = NULL;
+  ctx->writer = NULL;
+  memset(&ctx->callbacks, 0, sizeof(ctx->callbacks));
+}
 
+// Runs the state machine on `segment` until libjpeg runs out of input (and
+// suspends), the image is done, or there is an error.
+static void _ns_jpeg_process(struct NSJpegDecoderCtx *ctx) {
   int mismatch;
 
-  // Return here if there is a fatal error within libjpeg.
-  /*if (setjmp(ctx->err_setjmp_buf)) {
-    // TODO
-    fprintf(stderr, "WARNING: gckimg: error during decode\n");
-    return;
-  }*/
-
-  ctx->state = NS_JPEG_HEADER;
   switch (ctx->state) {
     case NS_JPEG_HEADER: {
       // Step 3: read file parameters with jpeg_read_header().
       if (jpeg_read_header(&ctx->info, TRUE) == JPEG_SUSPENDED) {
-        fprintf(stderr, "WARNING: gckimg: jpeg decode: read header suspended\n");
-        // TODO: error.
-        ctx->errorcode = -1;
-        return;
+        return; // I/O suspension
       }
 
       // Post our size to the superclass.
@@ -494,12 +914,25 @@ void gckimg_ns_jpeg_decode(
           fprintf(stderr, "WARNING: gckimg: ignoring exif orientation: %d\n", exif_orient_code);
         }
       }*/
-      ctx->width = ctx->info.image_width;
-      ctx->height = ctx->info.image_height;
+      _ns_jpeg_choose_scale(ctx);
+      jpeg_calc_output_dimensions(&ctx->info);
+      ctx->width = ctx->info.output_width;
+      ctx->height = ctx->info.output_height;
+      if (ctx->region_width != 0) {
+        // libjpeg exits on a bad crop, so check the window here.
+        if (ctx->region_height == 0 ||
+            ctx->region_x > ctx->width || ctx->region_width > ctx->width - ctx->region_x ||
+            ctx->region_y > ctx->height || ctx->region_height > ctx->height - ctx->region_y) {
+          ctx->errorcode = -1;
+          return;
+        }
+        ctx->width = ctx->region_width;
+        ctx->height = ctx->region_height;
+      }
       ctx->callbacks.init_size(ctx->writer, ctx->width, ctx->height);
 
       // We're doing a full decode.
-      ctx->in_profile = _jpeg_get_icc_profile(&ctx->info);
+      ctx->in_profile = _jpeg_get_icc_profile(&ctx->info, ctx->cm);
       if (ctx->in_profile != NULL && ctx->color_mgmt) {
         uint32_t profile_space = qcms_profile_get_color_space(ctx->in_profile);
         mismatch = 0;
@@ -543,7 +976,9 @@ void gckimg_ns_jpeg_decode(
               in_type = QCMS_DATA_GRAY_8;
               break;
             case JCS_RGB:
-              in_type = QCMS_DATA_RGB_8;
+              // Keep rows 4-byte strided end to end when we can; qcms
+              // passes the pad byte through like alpha.
+              in_type = _rgbx_cms_supported() ? QCMS_DATA_RGBA_8 : QCMS_DATA_RGB_8;
               break;
             default:
               // TODO: error.
@@ -563,17 +998,24 @@ void gckimg_ns_jpeg_decode(
           }
 #endif
 
-          if (ctx->cm->out_profile != NULL) {
+          if (gckimg_color_mgmt_matches_output(ctx->cm, ctx->in_profile)) {
+            // The transform would be the identity; leave it NULL so we
+            // decode straight to MOZ_JCS_EXT_NATIVE_ENDIAN_RGBX below.
+          } else if (ctx->cm->out_profile != NULL) {
             // Calculate rendering intent.
             int intent = qcms_profile_get_rendering_intent(ctx->in_profile);
 
             // Create the color management transform.
-            ctx->transform = qcms_transform_create(
+            ctx->transform = gckimg_color_mgmt_transform_create(
+                ctx->cm,
                 ctx->in_profile,
                 in_type,
-                ctx->cm->out_profile,
-                QCMS_DATA_RGB_8,
+                in_type == QCMS_DATA_RGBA_8 ? QCMS_DATA_RGBA_8 : QCMS_DATA_RGB_8,
                 (qcms_intent)(intent));
+            if (ctx->transform != NULL && in_type == QCMS_DATA_RGBA_8) {
+              ctx->info.out_color_space = MOZ_JCS_EXT_NATIVE_ENDIAN_RGBX;
+              ctx->info.out_color_components = 4;
+            }
           }
         } else {
           // TODO: ICM profile colorspace mismatch.
@@ -586,10 +1028,10 @@ void gckimg_ns_jpeg_decode(
           case JCS_GRAYSCALE:
           case JCS_RGB:
           case JCS_YCbCr:
-            // if we're not color managing we can decode directly to
-            // MOZ_JCS_EXT_NATIVE_ENDIAN_XRGB
-            ctx->info.out_color_space = MOZ_JCS_EXT_NATIVE_ENDIAN_RGBX;
-            ctx->info.out_color_components = 4;
+            // if we're not color managing we can decode directly to the
+            // writer's layout
+            ctx->info.out_color_space = _ns_jpeg_out_color_space(ctx->callbacks.pixel_format);
+            ctx->info.out_color_components = gckimg_pixel_format_bpp(ctx->callbacks.pixel_format);
             /*ctx->info.out_color_space = JCS_RGB;
             ctx->info.out_color_components = 3;*/
             break;
@@ -609,15 +1051,35 @@ void gckimg_ns_jpeg_decode(
       // Don't allocate a giant and superfluous memory buffer
       // when not doing a progressive decode.
       // TODO
-      ctx->info.buffered_image = jpeg_has_multiple_scans(&ctx->info);
+      // Without buffered-image mode, `jpeg_start_decompress` reads all the
+      // scans of a progressive image and there is a single output pass.
+      // Cropping and skipping need that too, so region decodes always use it.
+      // A preview needs buffered-image mode to output the image before all
+      // the scans are read; it still has a single output pass. Without the
+      // whole buffer up front (`gckimg_ns_jpeg_decode`), only `max_scans`
+      // applies.
+      if (!jpeg_has_multiple_scans(&ctx->info)) {
+        ctx->scan_limit = 0;
+      } else if (ctx->scan_limit == 0) {
+        ctx->scan_limit = ctx->max_scans;
+      }
+      ctx->info.buffered_image = jpeg_has_multiple_scans(&ctx->info) &&
+                                 (ctx->scan_limit != 0 ||
+                                  (!ctx->final_pass_only && ctx->region_width == 0));
 
       // Used to set up image size so arrays can be allocated
       jpeg_calc_output_dimensions(&ctx->info);
 
-      assert(NULL == ctx->input_buf);
-      assert(NULL == ctx->output_buf);
-      ctx->input_buf = (uint8_t *)malloc(sizeof(uint8_t) * 16UL * ctx->info.image_width);
-      ctx->output_buf = (uint8_t *)malloc(sizeof(uint8_t) * 16UL * ctx->info.image_width);
+      // Room for a batch of RGBX rows (`_ns_jpeg_output_rows`). A
+      // reused context keeps its buffers if they are big enough.
+      const size_t scratch_size = sizeof(uint8_t) * 4UL * JPEG_MAX_BATCH_ROWS * ctx->info.image_width;
+      if (ctx->scratch_size < scratch_size) {
+        free(ctx->input_buf);
+        free(ctx->output_buf);
+        ctx->input_buf = (uint8_t *)malloc(scratch_size);
+        ctx->output_buf = (uint8_t *)malloc(scratch_size);
+        ctx->scratch_size = scratch_size;
+      }
       assert(NULL != ctx->input_buf);
       assert(NULL != ctx->output_buf);
 
@@ -631,18 +1093,34 @@ void gckimg_ns_jpeg_decode(
       // FIXME -- Should reset dct_method and dither mode
       // for final pass of progressive JPEG
 
-      ctx->info.dct_method = JDCT_ISLOW;
+      ctx->info.dct_method = (J_DCT_METHOD)ctx->dct_method;
       ctx->info.dither_mode = JDITHER_FS;
-      ctx->info.do_fancy_upsampling = TRUE;
+      ctx->info.do_fancy_upsampling = ctx->fancy_upsampling ? TRUE : FALSE;
       ctx->info.enable_2pass_quant = FALSE;
-      ctx->info.do_block_smoothing = TRUE;
+      // Smoothing only fills in for coefficients of scans that haven't
+      // arrived yet, so skip it when only the final image is output.
+      ctx->info.do_block_smoothing = ctx->info.buffered_image && ctx->block_smoothing;
 
-      // Step 5: start decompressor.
+      // Step 5: start decompressor. Without buffered-image mode, this reads
+      // all the scans of a progressive image.
       if (jpeg_start_decompress(&ctx->info) == FALSE) {
-        // TODO: error.
-        fprintf(stderr, "WARNING: gckimg: error starting decompressor\n");
-        ctx->errorcode = -1;
-        return;
+        return; // I/O suspension
+      }
+      // For YCbCr, fold the transform into libjpeg's color conversion.
+      // Without fancy upsampling, jdmerge.c may do the conversion instead,
+      // and then there is no `cconvert` to hook. The hook writes 4 bytes a
+      // pixel, so packed RGB writers go through `_ns_jpeg_output_rows`.
+      ctx->ycc_cms = ctx->transform != NULL &&
+                     ctx->info.out_color_space == MOZ_JCS_EXT_NATIVE_ENDIAN_RGBX &&
+                     ctx->info.do_fancy_upsampling &&
+                     gckimg_pixel_format_bpp(ctx->callbacks.pixel_format) == 4 &&
+                     _ycc_cms_supported(&ctx->info);
+      if (ctx->ycc_cms) {
+        ctx->info.cconvert->color_convert = _ycc_cms_convert;
+      }
+      // In buffered-image mode the region is set up after `jpeg_start_output`.
+      if (ctx->region_width != 0 && !ctx->info.buffered_image) {
+        _ns_jpeg_start_region(ctx);
       }
 
       // If this is a progressive JPEG ...
@@ -655,13 +1133,10 @@ void gckimg_ns_jpeg_decode(
         int suspend = _ns_jpeg_output_scanlines(ctx);
 
         if (suspend) {
-          // TODO: I/O suspension.
-          fprintf(stderr, "WARNING: gckimg: I/O suspension (646)\n");
-          ctx->errorcode = -1;
           return; // I/O suspension
         }
 
-        assert(ctx->info.output_scanline == ctx->info.output_height
+        assert(ctx->info.output_scanline == ctx->crop_y + ctx->height
             && "We didn't process all of the data!");
         ctx->state = NS_JPEG_DONE;
       }
@@ -674,7 +1149,13 @@ void gckimg_ns_jpeg_decode(
         do {
           status = jpeg_consume_input(&ctx->info);
         } while (status != JPEG_SUSPENDED &&
-                 status != JPEG_REACHED_EOI);
+                 status != JPEG_REACHED_EOI &&
+                 !(status == JPEG_SCAN_COMPLETED && ctx->scan_limit != 0 &&
+                   ctx->info.input_scan_number >= (int)ctx->scan_limit));
+        if (status == JPEG_SUSPENDED && ctx->scan_limit != 0) {
+          // A preview only has an output pass once its scans are in.
+          return; // I/O suspension
+        }
 
         for (;;) {
           if (ctx->info.output_scanline == 0) {
@@ -685,16 +1166,16 @@ void gckimg_ns_jpeg_decode(
             // of the last full scan
             if ((ctx->info.output_scan_number == 0) &&
                 (scan > 1) &&
-                (status != JPEG_REACHED_EOI)) {
+                (status == JPEG_SUSPENDED)) {
               scan--;
             }
 
             if (!jpeg_start_output(&ctx->info, scan)) {
-              // TODO: I/O suspension.
-              fprintf(stderr, "WARNING: gckimg: I/O suspension (681)\n");
-              ctx->errorcode = -1;
               return; // I/O suspension
             }
+            if (ctx->region_width != 0) {
+              _ns_jpeg_start_region(ctx);
+            }
           }
 
           if (ctx->info.output_scanline == 0xffffff) {
@@ -709,17 +1190,17 @@ void gckimg_ns_jpeg_decode(
               // jpeg_start_output() multiple times for the same scan
               ctx->info.output_scanline = 0xffffff;
             }
-            // TODO: I/O suspension.
-            fprintf(stderr, "WARNING: gckimg: I/O suspension (700)\n");
-            ctx->errorcode = -1;
             return; // I/O suspension
           }
 
+          if (ctx->scan_limit != 0) {
+            // A preview is one output pass over the scans read so far;
+            // `NS_JPEG_DONE` drops the rest of the input.
+            break;
+          }
+
           if (ctx->info.output_scanline == ctx->info.output_height) {
             if (!jpeg_finish_output(&ctx->info)) {
-              // TODO: I/O suspension.
-              fprintf(stderr, "WARNING: gckimg: I/O suspension (708)\n");
-              ctx->errorcode = -1;
               return; // I/O suspension
             }
 
@@ -738,13 +1219,18 @@ void gckimg_ns_jpeg_decode(
     }
 
     case NS_JPEG_DONE: {
-      // Step 7: finish decompression.
-      if (jpeg_finish_decompress(&ctx->info) == FALSE) {
-        // TODO: I/O suspension; this shouldn't happen.
-        fprintf(stderr, "WARNING: gckimg: I/O suspension; this should not happen\n");
-        ctx->errorcode = -1;
+      if (ctx->info.output_scanline < ctx->info.output_height || ctx->scan_limit != 0) {
+        // A region decode stops at the bottom of the window, and a preview
+        // after its last scan; there is no need to read the rest of the
+        // image.
+        jpeg_abort_decompress(&ctx->info);
+        ctx->state = NS_JPEG_SINK_NON_JPEG_TRAILER;
         return;
       }
+      // Step 7: finish decompression; this reads up to the EOI marker.
+      if (jpeg_finish_decompress(&ctx->info) == FALSE) {
+        return; // I/O suspension
+      }
       // Make sure we don't feed any more data to libjpeg-turbo.
       ctx->state = NS_JPEG_SINK_NON_JPEG_TRAILER;
       // We're done.
@@ -766,3 +1252,65 @@ void gckimg_ns_jpeg_decode(
       return;
   }
 }
+
+void gckimg_ns_jpeg_begin(
+    struct NSJpegDecoderCtx *ctx,
+    const struct ColorMgmtCtx *cm,
+    void *writer, struct ImageWriterCallbacks callbacks)
+{
+  ctx->cm = cm;
+  ctx->writer = writer;
+  ctx->callbacks = callbacks;
+  ctx->state = NS_JPEG_HEADER;
+}
+
+int gckimg_ns_jpeg_feed(struct NSJpegDecoderCtx *ctx, const uint8_t *buf, size_t buf_len) {
+  // Return here if there is a fatal error within libjpeg.
+  /*if (setjmp(ctx->err_setjmp_buf)) {
+    // TODO
+    fprintf(stderr, "WARNING: gckimg: error during decode\n");
+    return;
+  }*/
+
+  // `segment_len` is 32 bits; libjpeg only suspends once it has used up a
+  // segment, so larger buffers can go in pieces.
+  do {
+    if (ctx->errorcode != 0) {
+      return -1;
+    }
+    if (ctx->state == NS_JPEG_SINK_NON_JPEG_TRAILER) {
+      return 1;
+    }
+    const uint32_t segment_len = buf_len > UINT32_MAX ? UINT32_MAX : (uint32_t)buf_len;
+    ctx->segment = (const JOCTET *)(buf);
+    ctx->segment_len = segment_len;
+    _ns_jpeg_process(ctx);
+    buf += segment_len;
+    buf_len -= segment_len;
+  } while (buf_len > 0);
+
+  if (ctx->errorcode != 0) {
+    return -1;
+  }
+  return ctx->state == NS_JPEG_SINK_NON_JPEG_TRAILER;
+}
+
+void gckimg_ns_jpeg_finish(struct NSJpegDecoderCtx *ctx) {
+  if (ctx->errorcode == 0 && ctx->state != NS_JPEG_SINK_NON_JPEG_TRAILER) {
+    ctx->errorcode = -1;
+  }
+}
+
+void gckimg_ns_jpeg_decode(
+    struct NSJpegDecoderCtx *ctx,
+    const struct ColorMgmtCtx *cm,
+    const uint8_t *buf, size_t buf_len,
+    void *writer, struct ImageWriterCallbacks callbacks)
+{
+  gckimg_ns_jpeg_begin(ctx, cm, writer, callbacks);
+  ctx->whole_input = 1;
+  // Limits that need to see the scans ahead of time.
+  ctx->scan_limit = _ns_jpeg_count_scan_limit(ctx, buf, buf_len);
+  gckimg_ns_jpeg_feed(ctx, buf, buf_len);
+  gckimg_ns_jpeg_finish(ctx);
+}
@@ -43,14 +43,51 @@ struct NSJpegDecoderCtx {
   uint32_t profile_len;
   uint8_t *input_buf;
   uint8_t *output_buf;
+  // Bytes in each of `input_buf` and `output_buf`; like `back_buffer`, they
+  // are kept for the next image (see `gckimg_ns_jpeg_reset`).
+  size_t scratch_size;
   uint32_t width;
   uint32_t height;
   qcms_profile *in_profile;
   qcms_transform *transform;
+  // Set when `transform` runs inside libjpeg's color conversion.
+  int ycc_cms;
   NSJpegState state;
   int errorcode;
   int color_mgmt;
-  struct ColorMgmtCtx *cm;
+  // If nonzero, decode at a reduced DCT scale (see
+  // `gckimg_ns_jpeg_set_target_size`).
+  uint32_t target_width;
+  uint32_t target_height;
+  // If `region_width` is nonzero, only decode this window of the output
+  // (see `gckimg_ns_jpeg_set_region`).
+  uint32_t region_x;
+  uint32_t region_y;
+  uint32_t region_width;
+  uint32_t region_height;
+  // Where the window starts in the rows libjpeg outputs: it decodes whole
+  // iMCU columns, so a cropped row may start up to an iMCU left of it.
+  uint32_t crop_x;
+  uint32_t crop_y;
+  // Set when all the input is there up front (`gckimg_ns_jpeg_decode`), so
+  // libjpeg can skip rows without suspending.
+  int whole_input;
+  // If nonzero (the default), progressive images are decoded in a single
+  // output pass once all the scans are in (see
+  // `gckimg_ns_jpeg_set_final_pass_only`).
+  int final_pass_only;
+  // Limits for a progressive preview (see `gckimg_ns_jpeg_set_scan_limit`),
+  // and the number of scans they come to for this image; a zero
+  // `scan_limit` means the whole image is decoded.
+  uint32_t max_scans;
+  size_t max_bytes;
+  int dc_scans_only;
+  uint32_t scan_limit;
+  // Speed/quality trade-offs (see `gckimg_ns_jpeg_set_quality`).
+  int dct_method;
+  int fancy_upsampling;
+  int block_smoothing;
+  const struct ColorMgmtCtx *cm;
   void *writer;
   struct ImageWriterCallbacks callbacks;
 };
@@ -58,9 +95,64 @@ struct NSJpegDecoderCtx {
 size_t gckimg_ns_jpeg_sizeof(void);
 void gckimg_ns_jpeg_init(struct NSJpegDecoderCtx *ctx, int color_mgmt);
 void gckimg_ns_jpeg_cleanup(struct NSJpegDecoderCtx *ctx);
+// Readies a context for the next image once it is done with one (or has
+// given up on it): frees what libjpeg allocated for the image and clears the
+// options, as `gckimg_ns_jpeg_init` left them. The libjpeg object, the source
+// manager and the input and row buffers are kept, so a context can decode
+// many images with a single `gckimg_ns_jpeg_init` and
+// `gckimg_ns_jpeg_cleanup`.
+void gckimg_ns_jpeg_reset(struct NSJpegDecoderCtx *ctx);
+// Decode at the smallest scale N/8 whose output is still at least
+// `width` x `height`; `init_size` reports the scaled size. Call between
+// `gckimg_ns_jpeg_init` and `gckimg_ns_jpeg_decode`.
+void gckimg_ns_jpeg_set_target_size(struct NSJpegDecoderCtx *ctx, uint32_t width, uint32_t height);
+// Only decode the `width` x `height` window at (`x`, `y`) of the (scaled)
+// output; `init_size` reports the window size and rows are numbered from its
+// top. Rows above and below it are skipped, and only the iMCU columns that
+// cover it are decoded. Call between `gckimg_ns_jpeg_init` and
+// `gckimg_ns_jpeg_decode`.
+void gckimg_ns_jpeg_set_region(struct NSJpegDecoderCtx *ctx, uint32_t x, uint32_t y, uint32_t width, uint32_t height);
+// With `final_pass_only` zero, progressive images go through libjpeg's
+// buffered-image mode and get an output pass (with block smoothing) for
+// each scan that is complete when output catches up with input. Otherwise
+// all the scans are read first and only the final image is output. Call
+// between `gckimg_ns_jpeg_init` and `gckimg_ns_jpeg_decode`.
+void gckimg_ns_jpeg_set_final_pass_only(struct NSJpegDecoderCtx *ctx, int final_pass_only);
+// Stop a progressive (or other multi-scan) image early and output what the
+// scans read so far give: the first `max_scans` scans, the scans that end in
+// the first `max_bytes` bytes, or with `dc_scans_only` the scans before the
+// first AC scan. Zero means no limit; with several limits the tightest wins,
+// but at least one scan is always read. Single-scan images are decoded in
+// full. `max_bytes` and `dc_scans_only` look at the whole buffer up front,
+// so only `gckimg_ns_jpeg_decode` applies them. Call between
+// `gckimg_ns_jpeg_init` and `gckimg_ns_jpeg_decode`.
+void gckimg_ns_jpeg_set_scan_limit(struct NSJpegDecoderCtx *ctx, uint32_t max_scans, size_t max_bytes, int dc_scans_only);
+// Trade quality for speed: `dct_method` is a `J_DCT_METHOD` (`JDCT_ISLOW`,
+// the default, `JDCT_IFAST` or `JDCT_FLOAT`); with `fancy_upsampling` zero,
+// chroma is upsampled by replication, which for 2h1v and 2h2v images merges
+// upsampling and color conversion into one pass (jdmerge.c); and with
+// `block_smoothing` zero, output passes of progressive images that are
+// missing AC scans are left blocky. Call between `gckimg_ns_jpeg_init` and
+// `gckimg_ns_jpeg_decode`.
+void gckimg_ns_jpeg_set_quality(struct NSJpegDecoderCtx *ctx, int dct_method, int fancy_upsampling, int block_smoothing);
+// Incremental decoding: after `gckimg_ns_jpeg_begin`, pass the input to
+// `gckimg_ns_jpeg_feed` in as many pieces as it comes in. It decodes as far
+// as the data goes and returns 1 once the image is done (later input is
+// ignored), 0 if it needs more, or -1 on error. The context keeps any
+// input it needs again, so `buf` can be reused as soon as the call returns.
+// `gckimg_ns_jpeg_finish` marks the end of the input, which is an error if
+// the image isn't done. Either way, call `gckimg_ns_jpeg_reset` or
+// `gckimg_ns_jpeg_cleanup` after.
+void gckimg_ns_jpeg_begin(
+    struct NSJpegDecoderCtx *ctx,
+    const struct ColorMgmtCtx *cm,
+    void *writer, struct ImageWriterCallbacks callbacks);
+int gckimg_ns_jpeg_feed(struct NSJpegDecoderCtx *ctx, const uint8_t *buf, size_t buf_len);
+void gckimg_ns_jpeg_finish(struct NSJpegDecoderCtx *ctx);
+// Decodes the whole image in `buf` at once.
 void gckimg_ns_jpeg_decode(
     struct NSJpegDecoderCtx *ctx,
-    struct ColorMgmtCtx *cm,
+    const struct ColorMgmtCtx *cm,
     const uint8_t *buf, size_t buf_len,
     void *writer, struct ImageWriterCallbacks callbacks);
 
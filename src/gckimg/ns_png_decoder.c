@@ -10,8 +10,10 @@
 #include "png.h"
 
 #include <assert.h>
+#include <math.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 // limit image dimensions (bug #251381, #591822, #967656, and #1283961)
 #ifndef MOZ_PNG_MAX_WIDTH
@@ -55,8 +57,23 @@ static void PNGAPI warning_callback(png_structp png, png_const_charp msg) {
   (void)msg;
 }
 
+// The PNG spec recommends that sRGB encoders also write these gAMA/cHRM
+// values, for decoders that don't understand the sRGB chunk.
+static int _png_chrm_gama_is_srgb(const qcms_CIE_xyY *whitePoint, const qcms_CIE_xyYTRIPLE *primaries, double gamma) {
+  const double tolerance = 0.001;
+  return fabs(gamma - 0.45455) <= 0.0005 &&
+         fabs(whitePoint->x - 0.3127) <= tolerance &&
+         fabs(whitePoint->y - 0.3290) <= tolerance &&
+         fabs(primaries->red.x - 0.64) <= tolerance &&
+         fabs(primaries->red.y - 0.33) <= tolerance &&
+         fabs(primaries->green.x - 0.30) <= tolerance &&
+         fabs(primaries->green.y - 0.60) <= tolerance &&
+         fabs(primaries->blue.x - 0.15) <= tolerance &&
+         fabs(primaries->blue.y - 0.06) <= tolerance;
+}
+
 // Adapted from http://www.littlecms.com/pngchrm.c example code
-static qcms_profile *_png_get_color_profile(png_structp png, png_infop info, int color_type, qcms_data_type *in_type, uint32_t *intent) {
+static qcms_profile *_png_get_color_profile(png_structp png, png_infop info, const struct ColorMgmtCtx *cm, int color_type, qcms_data_type *in_type, uint32_t *intent) {
   qcms_profile* profile = NULL;
   *intent = QCMS_INTENT_PERCEPTUAL; // Our default
 
@@ -70,7 +87,7 @@ static qcms_profile *_png_get_color_profile(png_structp png, png_infop info, int
     png_get_iCCP(png, info, &profileName, &compression,
                  &profileData, &profileLen);
 
-    profile = qcms_profile_from_memory((char*)profileData, profileLen);
+    profile = gckimg_color_mgmt_profile_from_memory(cm, (char*)profileData, profileLen);
     if (profile) {
       uint32_t profileSpace = qcms_profile_get_color_space(profile);
 
@@ -98,9 +115,10 @@ static qcms_profile *_png_get_color_profile(png_structp png, png_infop info, int
 
   // Check sRGB chunk
   if (!profile && png_get_valid(png, info, PNG_INFO_sRGB)) {
-    profile = qcms_profile_sRGB();
+    profile = gckimg_color_mgmt_srgb_profile();
 
     if (profile) {
+      profile = qcms_profile_reference(profile);
       int fileIntent;
       png_set_gray_to_rgb(png);
       png_get_sRGB(png, info, &fileIntent);
@@ -132,8 +150,15 @@ static qcms_profile *_png_get_color_profile(png_structp png, png_infop info, int
 
     png_get_gAMA(png, info, &gammaOfFile);
 
-    profile = qcms_profile_create_rgb_with_gamma(whitePoint, primaries,
-                                                 1.0/gammaOfFile);
+    if (_png_chrm_gama_is_srgb(&whitePoint, &primaries, gammaOfFile)) {
+      profile = gckimg_color_mgmt_srgb_profile();
+      if (profile) {
+        profile = qcms_profile_reference(profile);
+      }
+    } else {
+      profile = qcms_profile_create_rgb_with_gamma(whitePoint, primaries,
+                                                   1.0/gammaOfFile);
+    }
 
     if (profile) {
       png_set_gray_to_rgb(png);
@@ -161,6 +186,44 @@ static qcms_profile *_png_get_color_profile(png_structp png, png_infop info, int
   return profile;
 }
 
+// Where each Adam7 pass (0-6) starts, and its spacing, in both directions.
+static const uint8_t _adam7_x_start[] = { 0, 4, 0, 2, 0, 1, 0 };
+static const uint8_t _adam7_x_inc[] = { 8, 8, 4, 4, 2, 2, 1 };
+static const uint8_t _adam7_y_start[] = { 0, 0, 4, 0, 2, 0, 1 };
+static const uint8_t _adam7_y_inc[] = { 8, 8, 8, 4, 4, 2, 2 };
+
+// Picks the largest reduction 2^shift (up to 8) that keeps an interlaced
+// image at least the target size; pass `2 * (3 - shift)` is the last one
+// with pixels on that grid.
+static uint32_t _png_choose_scale_shift(const struct NSPngDecoderCtx *ctx, uint32_t width, uint32_t height) {
+  if (ctx->target_width == 0 && ctx->target_height == 0) {
+    return 0;
+  }
+  for (uint32_t shift = 3; shift > 0; shift--) {
+    const uint32_t scale = 1U << shift;
+    if ((width + scale - 1) / scale >= ctx->target_width &&
+        (height + scale - 1) / scale >= ctx->target_height) {
+      return shift;
+    }
+  }
+  return 0;
+}
+
+// Returns at least `size` bytes from `scratch`, reallocating it if it is
+// too small. The contents are left over from earlier images.
+static uint8_t *_png_scratch(struct NSPngScratch *scratch, size_t size) {
+  if (scratch->size < size) {
+    free(scratch->buf);
+    scratch->buf = (uint8_t *)(malloc(size));
+    scratch->size = scratch->buf != NULL ? size : 0;
+  }
+  return scratch->buf;
+}
+
+// What `_combine_scaled_row` longjmps with once it has all the passes it
+// needs; libpng's own errors longjmp with 1.
+#define PNG_SCALED_DONE 2
+
 static void _png_do_gamma_correction(png_structp png, png_infop info) {
   // Sets up gamma pre-correction in libpng before our callback gets called.
   // We need to do this if we don't end up with a CMS profile.
@@ -194,11 +257,14 @@ static void PNGAPI info_callback(png_structp _png, png_infop _info) {
       &width, &height, &bit_depth, &color_type,
       &interlace_type, &compression_type, &filter_type);
 
-  ctx->width = width;
-  ctx->height = height;
+  if (interlace_type == PNG_INTERLACE_ADAM7) {
+    ctx->scale_shift = _png_choose_scale_shift(ctx, width, height);
+  }
+  ctx->width = (width + (1U << ctx->scale_shift) - 1) >> ctx->scale_shift;
+  ctx->height = (height + (1U << ctx->scale_shift) - 1) >> ctx->scale_shift;
 
   // Post our size to the superclass.
-  ctx->callbacks.init_size(ctx->writer, width, height);
+  ctx->callbacks.init_size(ctx->writer, ctx->width, ctx->height);
 
   // TODO: check size limits.
 
@@ -239,11 +305,13 @@ static void PNGAPI info_callback(png_structp _png, png_infop _info) {
 
   qcms_data_type in_type = QCMS_DATA_RGBA_8;
   uint32_t intent = (uint32_t)(-1);
+  int in_profile_matches_output = 0;
   if (ctx->color_mgmt) {
     uint32_t p_intent;
     ctx->in_profile = _png_get_color_profile(
         ctx->png,
         ctx->info,
+        ctx->cm,
         color_type,
         &in_type,
         &p_intent);
@@ -251,31 +319,43 @@ static void PNGAPI info_callback(png_structp _png, png_infop _info) {
     if (intent == (uint32_t)(-1)) {
       intent = p_intent;
     }
+    if (ctx->in_profile != NULL &&
+        gckimg_color_mgmt_matches_output(ctx->cm, ctx->in_profile)) {
+      // The transform would be the identity, and the image is already in
+      // the output space, so no gamma correction either.
+      qcms_profile_release(ctx->in_profile);
+      ctx->in_profile = NULL;
+      in_profile_matches_output = 1;
+    }
   }
   if (ctx->in_profile != NULL && ctx->color_mgmt) {
-    qcms_data_type out_type;
-
-    if ((color_type & PNG_COLOR_MASK_ALPHA) || num_trans) {
-      out_type = QCMS_DATA_RGBA_8;
-      ctx->out_channels = 4;
-    } else {
-      out_type = QCMS_DATA_RGB_8;
-      ctx->out_channels = 3;
+    // Pad opaque images with an alpha byte, so the transform always writes
+    // RGBX rows that can go straight into the writer's raster.
+    if (in_type == QCMS_DATA_RGB_8 || in_type == QCMS_DATA_GRAY_8) {
+      png_set_filler(ctx->png, 0xff, PNG_FILLER_AFTER);
+      in_type = in_type == QCMS_DATA_RGB_8 ? QCMS_DATA_RGBA_8 : QCMS_DATA_GRAYA_8;
     }
+    ctx->out_channels = 4;
 
-    ctx->transform = qcms_transform_create(
+    ctx->transform = gckimg_color_mgmt_transform_create(
+        ctx->cm,
         ctx->in_profile,
         in_type,
-        ctx->cm->out_profile,
-        out_type,
+        QCMS_DATA_RGBA_8,
         (qcms_intent)(intent));
   } else {
     ctx->out_channels = 0;
 
     png_set_gray_to_rgb(ctx->png);
+    if (!(color_type & PNG_COLOR_MASK_ALPHA) && 0 == num_trans &&
+        ctx->callbacks.pixel_format != IMAGE_PIXEL_FORMAT_RGB) {
+      // Likewise, decode opaque images as RGBX, unless the writer stores
+      // packed RGB.
+      png_set_filler(ctx->png, 0xff, PNG_FILLER_AFTER);
+    }
 
     // only do gamma correction if CMS isn't entirely disabled
-    if (ctx->color_mgmt) {
+    if (ctx->color_mgmt && !in_profile_matches_output) {
       _png_do_gamma_correction(ctx->png, ctx->info);
     }
 
@@ -283,9 +363,10 @@ static void PNGAPI info_callback(png_structp _png, png_infop _info) {
     // so do not force a color space transform.
   }
 
-  // Let libpng expand interlaced images.
+  // Let libpng expand interlaced images, unless `row_callback` picks out
+  // the pixels of a reduced scale itself.
   const int is_interlaced = interlace_type == PNG_INTERLACE_ADAM7;
-  if (is_interlaced) {
+  if (is_interlaced && ctx->scale_shift == 0) {
     png_set_interlace_handling(ctx->png);
   }
 
@@ -310,23 +391,33 @@ static void PNGAPI info_callback(png_structp _png, png_infop _info) {
   // as `ctx->callbacks.init_size()` is sufficient.
   ctx->pass = 0;
 
-  if (ctx->transform && (channels <= 2 || is_interlaced)) {
+  // Interlaced rows are combined with the next pass unless that was the
+  // last write, so transform them (or put them in the writer's layout) out
+  // of place.
+  const int combined_rows = is_interlaced && !ctx->final_pass_only && ctx->scale_shift == 0;
+  if ((ctx->transform && (channels <= 2 || combined_rows)) ||
+      (ctx->callbacks.pixel_format != IMAGE_PIXEL_FORMAT_RGBX && combined_rows)) {
     const uint32_t bpp[] = { 0, 3, 4, 3, 4 };
     assert(channels <= 4);
     const uint32_t cms_channels = bpp[channels];
-    assert(cms_channels == ctx->out_channels);
-    ctx->cms_line = (uint8_t *)(malloc(sizeof(uint8_t) * cms_channels * width));
+    assert(!ctx->transform || cms_channels == ctx->out_channels);
+    ctx->cms_line = _png_scratch(&ctx->cms_line_scratch, sizeof(uint8_t) * cms_channels * width);
     if (ctx->cms_line == NULL) {
       png_error(ctx->png, "malloc of mCMSLine failed");
     }
   }
 
   if (interlace_type == PNG_INTERLACE_ADAM7) {
-    const size_t buffer_size = (size_t)(channels) * (size_t)(width) * (size_t)(height);
-    ctx->interlace_buf = (uint8_t *)(malloc(buffer_size));
+    const size_t buffer_size = (size_t)(channels) * (size_t)(ctx->width) * (size_t)(ctx->height);
+    ctx->interlace_buf = _png_scratch(&ctx->interlace_scratch, buffer_size);
     if (ctx->interlace_buf == NULL) {
       png_error(ctx->png, "malloc of interlacebuf failed");
     }
+    // At a reduced scale, rows of a truncated image may only be partly
+    // filled in, so start them out zeroed.
+    if (ctx->scale_shift != 0) {
+      memset(ctx->interlace_buf, 0, buffer_size);
+    }
   }
 }
 
@@ -335,7 +426,30 @@ static void _write_row(struct NSPngDecoderCtx *ctx, uint32_t row_num, uint8_t *r
 
   uint8_t *row_to_write = row;
   const uint32_t width = ctx->width;
-  const uint32_t out_channels = ctx->out_channels;
+  uint32_t out_channels = ctx->out_channels;
+  const int pixel_format = ctx->callbacks.pixel_format;
+
+  // If the writer hands out its row, transform or copy straight into it.
+  // Packed RGB rows are only decoded for writers that store them.
+  if ((out_channels == 3 || out_channels == 4) && ctx->callbacks.get_row_buffer != NULL) {
+    uint8_t *dest_row = ctx->callbacks.get_row_buffer(ctx->writer, row_num);
+    if (dest_row != NULL) {
+      if (out_channels == 3) {
+        memcpy(dest_row, row_to_write, 3 * width);
+      } else if (ctx->transform && pixel_format == IMAGE_PIXEL_FORMAT_RGBX) {
+        qcms_transform_data(ctx->transform, row_to_write, dest_row, width);
+      } else {
+        // qcms only writes RGBX, so reorder its output on the way in.
+        if (ctx->transform) {
+          uint8_t *cms_row = ctx->cms_line != NULL ? ctx->cms_line : row_to_write;
+          qcms_transform_data(ctx->transform, row_to_write, cms_row, width);
+          row_to_write = cms_row;
+        }
+        gckimg_store_rgbx(row_to_write, dest_row, width, pixel_format);
+      }
+      return;
+    }
+  }
 
   // Apply color management to the row, if necessary, before writing it out.
   if (ctx->transform) {
@@ -355,6 +469,15 @@ static void _write_row(struct NSPngDecoderCtx *ctx, uint32_t row_num, uint8_t *r
     }
   }
 
+  // Put RGBX rows in the writer's layout. Rows that libpng combines with the
+  // next pass are left as they are.
+  if (out_channels == 4 && pixel_format != IMAGE_PIXEL_FORMAT_RGBX) {
+    uint8_t *out_row = ctx->cms_line != NULL ? ctx->cms_line : row_to_write;
+    gckimg_store_rgbx(row_to_write, out_row, width, pixel_format);
+    row_to_write = out_row;
+    out_channels = gckimg_pixel_format_bpp(pixel_format);
+  }
+
   // Write this row to the SurfacePipe.
   // TODO: packing to the correct pixel format.
   /*ctx->callbacks.write_row(ctx->writer, row_num, row_to_write, out_channels * width);*/
@@ -376,6 +499,65 @@ static void _write_row(struct NSPngDecoderCtx *ctx, uint32_t row_num, uint8_t *r
   }
 }
 
+// Writes out the rows of `interlace_buf` that are pending in
+// final-pass-only mode.
+static void _write_interlaced_rows(struct NSPngDecoderCtx *ctx) {
+  const uint32_t num_rows = ctx->interlace_rows;
+  const size_t stride = (size_t)(ctx->channels) * (size_t)(ctx->width);
+
+  ctx->interlace_rows = 0;
+  if (ctx->out_channels == 4 && ctx->transform == NULL &&
+      ctx->callbacks.get_row_buffer == NULL && ctx->callbacks.write_rows_rgbx != NULL &&
+      gckimg_pixel_format_bpp(ctx->callbacks.pixel_format) == 4) {
+    // The rows are already RGBX and contiguous, and this is their only write.
+    if (num_rows > 0) {
+      gckimg_store_rgbx(ctx->interlace_buf, ctx->interlace_buf, (size_t)(ctx->width) * num_rows,
+                        ctx->callbacks.pixel_format);
+      ctx->callbacks.write_rows_rgbx(ctx->writer, 0, num_rows, ctx->interlace_buf, stride, ctx->width);
+    }
+    return;
+  }
+  for (uint32_t row_num = 0; row_num < num_rows; row_num++) {
+    _write_row(ctx, row_num, ctx->interlace_buf + row_num * stride);
+  }
+}
+
+// Places the pixels of a row of pass `pass` on the reduced grid, and stops
+// decoding after the last pass with pixels on it.
+static void _combine_scaled_row(struct NSPngDecoderCtx *ctx, const uint8_t *new_row, uint32_t row_num, int pass) {
+  const uint32_t shift = ctx->scale_shift;
+  const int last_pass = 2 * (3 - (int)(shift));
+  png_uint_32 full_width, full_height;
+  png_get_IHDR(ctx->png, ctx->info, &full_width, &full_height, NULL, NULL, NULL, NULL, NULL);
+
+  if (pass > last_pass) {
+    // libpng skips passes that are empty for small images.
+    png_longjmp(ctx->png, PNG_SCALED_DONE);
+  }
+
+  const uint32_t channels = ctx->channels;
+  const uint32_t y = _adam7_y_start[pass] + row_num * _adam7_y_inc[pass];
+  const uint32_t num_pixels = (full_width + _adam7_x_inc[pass] - 1 - _adam7_x_start[pass]) / _adam7_x_inc[pass];
+  const uint32_t x_step = channels * (_adam7_x_inc[pass] >> shift);
+  uint8_t *dest = ctx->interlace_buf + (size_t)(channels) *
+      ((size_t)(y >> shift) * ctx->width + (_adam7_x_start[pass] >> shift));
+
+  for (uint32_t i = 0; i < num_pixels; i++) {
+    memcpy(dest, new_row, channels);
+    dest += x_step;
+    new_row += channels;
+  }
+  if ((y >> shift) >= ctx->interlace_rows) {
+    ctx->interlace_rows = (y >> shift) + 1;
+  }
+
+  if (pass == last_pass && y + _adam7_y_inc[pass] >= full_height) {
+    // That was the last row on the grid: skip inflating the rest of the
+    // image data. `gckimg_ns_png_feed` writes the rows.
+    png_longjmp(ctx->png, PNG_SCALED_DONE);
+  }
+}
+
 static void PNGAPI row_callback(png_structp _png, png_bytep new_row, png_uint_32 row_num, int pass) {
   /* libpng comments:
    *
@@ -418,6 +600,11 @@ static void PNGAPI row_callback(png_structp _png, png_bytep new_row, png_uint_32
     ctx->pass++;
   }
 
+  if (ctx->scale_shift != 0) {
+    _combine_scaled_row(ctx, new_row, row_num, pass);
+    return;
+  }
+
   const png_uint_32 height = ctx->height;
   if (row_num >= height) {
     // Bail if we receive extra rows. This is especially important because if we
@@ -441,6 +628,15 @@ static void PNGAPI row_callback(png_structp _png, png_bytep new_row, png_uint_32
 
     // Update the deinterlaced version of this row with the new data.
     png_progressive_combine_row(ctx->png, row_to_write, new_row);
+
+    if (ctx->final_pass_only) {
+      // The first pass fills in every row (libpng replicates its pixels);
+      // `_write_interlaced_rows` writes them once the passes are done.
+      if (ctx->pass == 0 && row_num >= ctx->interlace_rows) {
+        ctx->interlace_rows = row_num + 1;
+      }
+      return;
+    }
   }
 
   _write_row(ctx, row_num, row_to_write);
@@ -448,8 +644,11 @@ static void PNGAPI row_callback(png_structp _png, png_bytep new_row, png_uint_32
 
 static void PNGAPI end_callback(png_structp _png, png_infop _info) {
   // TODO: this is for error checking.
-  (void)_png;
   (void)_info;
+
+  struct NSPngDecoderCtx *ctx = (struct NSPngDecoderCtx *)(png_get_progressive_ptr(_png));
+  _write_interlaced_rows(ctx);
+  ctx->done = 1;
 }
 
 size_t gckimg_ns_png_sizeof(void) {
@@ -470,6 +669,7 @@ void gckimg_ns_png_init(struct NSPngDecoderCtx *ctx, int color_mgmt) {
   assert(ctx->info != NULL);
 
   ctx->color_mgmt = color_mgmt;
+  ctx->final_pass_only = 1;
 
 #ifdef PNG_HANDLE_AS_UNKNOWN_SUPPORTED
   // Ignore unused chunks
@@ -509,16 +709,29 @@ void gckimg_ns_png_init(struct NSPngDecoderCtx *ctx, int color_mgmt) {
 #endif
 }
 
+void gckimg_ns_png_set_final_pass_only(struct NSPngDecoderCtx *ctx, int final_pass_only) {
+  ctx->final_pass_only = final_pass_only;
+}
+
+void gckimg_ns_png_set_target_size(struct NSPngDecoderCtx *ctx, uint32_t width, uint32_t height) {
+  ctx->target_width = width;
+  ctx->target_height = height;
+}
+
 void gckimg_ns_png_cleanup(struct NSPngDecoderCtx *ctx) {
+  gckimg_ns_png_reset(ctx);
+  free(ctx->cms_line_scratch.buf);
+  free(ctx->interlace_scratch.buf);
+  ctx->cms_line_scratch.buf = NULL;
+  ctx->cms_line_scratch.size = 0;
+  ctx->interlace_scratch.buf = NULL;
+  ctx->interlace_scratch.size = 0;
+}
+
+void gckimg_ns_png_reset(struct NSPngDecoderCtx *ctx) {
   if (ctx->png != NULL) {
     png_destroy_read_struct(&ctx->png, &ctx->info, NULL);
   }
-  if (ctx->cms_line != NULL) {
-    free(ctx->cms_line);
-  }
-  if (ctx->interlace_buf != NULL) {
-    free(ctx->interlace_buf);
-  }
   if (ctx->in_profile != NULL) {
     qcms_profile_release(ctx->in_profile);
     // mTransform belongs to us only if mInProfile is non-null
@@ -526,20 +739,20 @@ void gckimg_ns_png_cleanup(struct NSPngDecoderCtx *ctx) {
       qcms_transform_release(ctx->transform);
     }
   }
+
+  // Everything else is per image.
+  const struct NSPngScratch cms_line_scratch = ctx->cms_line_scratch;
+  const struct NSPngScratch interlace_scratch = ctx->interlace_scratch;
+  memset(ctx, 0, sizeof(struct NSPngDecoderCtx));
+  ctx->cms_line_scratch = cms_line_scratch;
+  ctx->interlace_scratch = interlace_scratch;
 }
 
-void gckimg_ns_png_decode(
+void gckimg_ns_png_begin(
     struct NSPngDecoderCtx *ctx,
-    struct ColorMgmtCtx *cm,
-    const uint8_t *buf, size_t buf_len,
+    const struct ColorMgmtCtx *cm,
     void *writer, struct ImageWriterCallbacks callbacks)
 {
-  // libpng uses setjmp/longjmp for error handling.
-  if (setjmp(png_jmpbuf(ctx->png))) {
-    // TODO
-    return;
-  }
-
   ctx->cm = cm;
   ctx->writer = writer;
   ctx->callbacks = callbacks;
@@ -551,7 +764,53 @@ void gckimg_ns_png_decode(
       info_callback,
       row_callback,
       end_callback);
+}
+
+int gckimg_ns_png_feed(struct NSPngDecoderCtx *ctx, const uint8_t *buf, size_t buf_len) {
+  if (ctx->done) {
+    return ctx->errorcode != 0 ? -1 : 1;
+  }
+
+  // libpng uses setjmp/longjmp for error handling.
+  switch (setjmp(png_jmpbuf(ctx->png))) {
+    case 0:
+      break;
+    case PNG_SCALED_DONE:
+      // A reduced-scale decode has all the passes it needs.
+      _write_interlaced_rows(ctx);
+      ctx->done = 1;
+      return 1;
+    default:
+      // libpng can't go on with a broken image.
+      ctx->errorcode = -1;
+      ctx->done = 1;
+      return -1;
+  }
 
   // Pass the data off to libpng.
   png_process_data(ctx->png, ctx->info, (png_bytep)buf, buf_len);
+  return ctx->done;
+}
+
+void gckimg_ns_png_finish(struct NSPngDecoderCtx *ctx) {
+  // Truncated images never reach `end_callback`; without even the header,
+  // there is nothing to write.
+  if (!ctx->done) {
+    if (ctx->width == 0) {
+      ctx->errorcode = -1;
+    } else {
+      _write_interlaced_rows(ctx);
+    }
+  }
+}
+
+void gckimg_ns_png_decode(
+    struct NSPngDecoderCtx *ctx,
+    const struct ColorMgmtCtx *cm,
+    const uint8_t *buf, size_t buf_len,
+    void *writer, struct ImageWriterCallbacks callbacks)
+{
+  gckimg_ns_png_begin(ctx, cm, writer, callbacks);
+  gckimg_ns_png_feed(ctx, buf, buf_len);
+  gckimg_ns_png_finish(ctx);
 }
@@ -14,6 +14,13 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+// A buffer that a context keeps for the next image (see
+// `gckimg_ns_png_reset`).
+struct NSPngScratch {
+  uint8_t *buf;
+  size_t size;
+};
+
 struct NSPngDecoderCtx {
   png_structp png;
   png_infop info;
@@ -26,9 +33,27 @@ struct NSPngDecoderCtx {
   uint32_t out_channels;
   uint8_t *cms_line;
   uint8_t *interlace_buf;
+  // Where `cms_line` and `interlace_buf` are allocated, when the image
+  // needs them.
+  struct NSPngScratch cms_line_scratch;
+  struct NSPngScratch interlace_scratch;
+  // If nonzero (the default), interlaced images are only written out once
+  // all the passes are combined (see `gckimg_ns_png_set_final_pass_only`).
+  int final_pass_only;
+  // Rows of `interlace_buf` that the first pass has filled in and that
+  // haven't been written yet.
+  uint32_t interlace_rows;
+  // If nonzero, decode interlaced images at a reduced scale (see
+  // `gckimg_ns_png_set_target_size`); `scale_shift` is log2 of the
+  // reduction, and `width`/`height` are the reduced size.
+  uint32_t target_width;
+  uint32_t target_height;
+  uint32_t scale_shift;
+  // Set once libpng has read the whole image, or stopped early.
+  int done;
   int errorcode;
   int color_mgmt;
-  struct ColorMgmtCtx *cm;
+  const struct ColorMgmtCtx *cm;
   void *writer;
   struct ImageWriterCallbacks callbacks;
 };
@@ -36,9 +61,44 @@ struct NSPngDecoderCtx {
 size_t gckimg_ns_png_sizeof(void);
 void gckimg_ns_png_init(struct NSPngDecoderCtx *ctx, int color_mgmt);
 void gckimg_ns_png_cleanup(struct NSPngDecoderCtx *ctx);
+// Readies a context for the next image once it is done with one (or has
+// given up on it). libpng has no way to rewind a read struct, so this
+// destroys it along with the rest of the image's state, but the row buffers
+// are kept; call `gckimg_ns_png_init` again before the next image.
+void gckimg_ns_png_reset(struct NSPngDecoderCtx *ctx);
+// With `final_pass_only` zero, each row of an interlaced (Adam7) image is
+// written on every pass that touches it, so the writer sees the image
+// refine. Otherwise the passes are only combined, and every row is color
+// managed and written once, at the end (or when decoding stops early). Call
+// between `gckimg_ns_png_init` and `gckimg_ns_png_decode`.
+void gckimg_ns_png_set_final_pass_only(struct NSPngDecoderCtx *ctx, int final_pass_only);
+// Decode interlaced (Adam7) images at the smallest scale 1/8, 1/4 or 1/2
+// whose output is still at least `width` x `height`, by stopping after
+// pass 1, 3 or 5 of the 7; `init_size` reports the reduced size, and the
+// rest of the image data isn't inflated. Non-interlaced images are decoded
+// at full size. Call between `gckimg_ns_png_init` and
+// `gckimg_ns_png_decode`.
+void gckimg_ns_png_set_target_size(struct NSPngDecoderCtx *ctx, uint32_t width, uint32_t height);
+// Incremental decoding, as with the JPEG decoder: after
+// `gckimg_ns_png_begin`, pass the input to `gckimg_ns_png_feed` in as many
+// pieces as it comes in. It returns 1 once the image is done (later input
+// is ignored), 0 if it needs more, or -1 if libpng gave up on the image
+// (`errorcode` is set, and later calls return -1 too). libpng keeps what it
+// needs, so `buf` can be reused as soon as the call returns.
+// `gckimg_ns_png_finish` marks the end of the input; for a truncated image
+// it writes out the rows the final-pass-only mode still holds, and it is an
+// error if the header never arrived. Either way, call `gckimg_ns_png_reset`
+// or `gckimg_ns_png_cleanup` after.
+void gckimg_ns_png_begin(
+    struct NSPngDecoderCtx *ctx,
+    const struct ColorMgmtCtx *cm,
+    void *writer, struct ImageWriterCallbacks callbacks);
+int gckimg_ns_png_feed(struct NSPngDecoderCtx *ctx, const uint8_t *buf, size_t buf_len);
+void gckimg_ns_png_finish(struct NSPngDecoderCtx *ctx);
+// Decodes the whole image in `buf` at once.
 void gckimg_ns_png_decode(
     struct NSPngDecoderCtx *ctx,
-    struct ColorMgmtCtx *cm,
+    const struct ColorMgmtCtx *cm,
     const uint8_t *buf, size_t buf_len,
     void *writer, struct ImageWriterCallbacks callbacks);
 
@@ -814,7 +814,10 @@ static void read_rendering_intent(qcms_profile *profile, struct mem_source *src)
 
 qcms_profile *qcms_profile_create(void)
 {
-	return calloc(sizeof(qcms_profile), 1);
+	qcms_profile *profile = calloc(sizeof(qcms_profile), 1);
+	if (profile)
+		profile->ref_count = 1;
+	return profile;
 }
 
 
@@ -1042,7 +1045,7 @@ qcms_profile* qcms_profile_sRGB(void)
 
 
 /* qcms_profile_from_memory does not hold a reference to the memory passed in */
-qcms_profile* qcms_profile_from_memory(const void *mem, size_t size)
+static qcms_profile* profile_from_memory(const void *mem, size_t size, qcms_bool iccv4)
 {
 	uint32_t length;
 	struct mem_source source;
@@ -1072,6 +1075,7 @@ qcms_profile* qcms_profile_from_memory(const void *mem, size_t size)
 	profile = qcms_profile_create();
 	if (!profile)
 		return NO_MEM_PROFILE;
+	profile->iccv4 = iccv4;
 
 	check_CMM_type_signature(src);
 	check_profile_version(src);
@@ -1113,7 +1117,7 @@ qcms_profile* qcms_profile_from_memory(const void *mem, size_t size)
 					profile->mBA = read_tag_lutmABType(src, index, TAG_B2A0);
 				}
 			}
-			if (find_tag(index, TAG_rXYZ) || !qcms_supports_iccv4) {
+			if (find_tag(index, TAG_rXYZ) || !iccv4) {
 				profile->redColorant = read_tag_XYZType(src, index, TAG_rXYZ);
 				profile->greenColorant = read_tag_XYZType(src, index, TAG_gXYZ);
 				profile->blueColorant = read_tag_XYZType(src, index, TAG_bXYZ);
@@ -1122,7 +1126,7 @@ qcms_profile* qcms_profile_from_memory(const void *mem, size_t size)
 			if (!src->valid)
 				goto invalid_tag_table;
 
-			if (find_tag(index, TAG_rTRC) || !qcms_supports_iccv4) {
+			if (find_tag(index, TAG_rTRC) || !iccv4) {
 				profile->redTRC = read_tag_curveType(src, index, TAG_rTRC);
 				profile->greenTRC = read_tag_curveType(src, index, TAG_gTRC);
 				profile->blueTRC = read_tag_curveType(src, index, TAG_bTRC);
@@ -1158,6 +1162,16 @@ invalid_profile:
 	return INVALID_PROFILE;
 }
 
+qcms_profile* qcms_profile_from_memory(const void *mem, size_t size)
+{
+	return profile_from_memory(mem, size, qcms_supports_iccv4);
+}
+
+qcms_profile* qcms_profile_from_memory_iccv4(const void *mem, size_t size)
+{
+	return profile_from_memory(mem, size, true);
+}
+
 qcms_intent qcms_profile_get_rendering_intent(qcms_profile *profile)
 {
 	return profile->rendering_intent;
@@ -1174,8 +1188,17 @@ static void lut_release(struct lutType *lut)
 	free(lut);
 }
 
+qcms_profile *qcms_profile_reference(qcms_profile *profile)
+{
+	qcms_atomic_increment(profile->ref_count);
+	return profile;
+}
+
 void qcms_profile_release(qcms_profile *profile)
 {
+	if (qcms_atomic_decrement(profile->ref_count) != 0)
+		return;
+
 	if (profile->output_table_r)
 		precache_release(profile->output_table_r);
 	if (profile->output_table_g)
@@ -44,6 +44,12 @@ authorization from SunSoft Inc.
  * QCMS, in general, is not threadsafe. However, it should be safe to create
  * profile and transformation objects on different threads, so long as you
  * don't use the same objects on different threads at the same time.
+ *
+ * Profiles and transforms are reference counted with atomic counts. Once a
+ * transform has been created, qcms_transform_data only reads from it and
+ * from its profiles' precached tables, so a transform (and a profile whose
+ * output transform has already been precached) may be shared between
+ * threads.
  */
 
 /* 
@@ -142,6 +148,9 @@ void qcms_data_create_rgb_with_gamma(
                 size_t *size);
 
 qcms_profile* qcms_profile_from_memory(const void *mem, size_t size);
+/* Parses the profile as if qcms_enable_iccv4 had been called, without
+ * changing the process-wide setting */
+qcms_profile* qcms_profile_from_memory_iccv4(const void *mem, size_t size);
 
 qcms_profile* qcms_profile_from_file(FILE *file);
 qcms_profile* qcms_profile_from_path(const char *path);
@@ -153,9 +162,11 @@ qcms_profile* qcms_profile_from_unicode_path(const wchar_t *path);
 void qcms_data_from_unicode_path(const wchar_t *path, void **mem, size_t *size);
 #endif
 qcms_profile* qcms_profile_sRGB(void);
+qcms_profile* qcms_profile_reference(qcms_profile *profile);
 void qcms_profile_release(qcms_profile *profile);
 
 qcms_bool qcms_profile_is_bogus(qcms_profile *profile);
+qcms_bool qcms_profile_match(qcms_profile *a, qcms_profile *b);
 qcms_intent qcms_profile_get_rendering_intent(qcms_profile *profile);
 icColorSpaceSignature qcms_profile_get_color_space(qcms_profile *profile);
 
@@ -166,6 +177,14 @@ qcms_transform* qcms_transform_create(
 		qcms_profile* out, qcms_data_type out_type,
 		qcms_intent intent);
 
+/* For transforms that interpolate a precomputed CLUT (ICC v4 LUT profiles):
+ * returns the interleaved r, g, b grid, grid_size^3 points in r-major order,
+ * or NULL for any other kind of transform */
+const float *qcms_transform_get_clut(qcms_transform *transform, int *grid_size);
+/* Rebuilds such a transform from a copy of its CLUT */
+qcms_transform* qcms_transform_create_from_clut(const float *clut, int grid_size, qcms_data_type in_type);
+
+qcms_transform* qcms_transform_reference(qcms_transform *);
 void qcms_transform_release(qcms_transform *);
 
 void qcms_transform_data(qcms_transform *transform, void *src, void *dest, size_t length);
@@ -16,6 +16,8 @@ struct precache_output
 #define PRECACHE_OUTPUT_SIZE 8192
 #define PRECACHE_OUTPUT_MAX (PRECACHE_OUTPUT_SIZE-1)
 	uint8_t data[PRECACHE_OUTPUT_SIZE];
+	/* lets the AVX2 kernels gather a 32-bit word at any index of data */
+	uint8_t gather_pad[3];
 };
 
 #ifdef _MSC_VER
@@ -68,6 +70,8 @@ struct _qcms_transform {
 	struct precache_output *output_table_b;
 
 	void (*transform_fn)(struct _qcms_transform *transform, unsigned char *src, unsigned char *dest, size_t length);
+
+	int ref_count;
 };
 
 struct matrix {
@@ -224,6 +228,12 @@ struct _qcms_profile {
 	struct precache_output *output_table_r;
 	struct precache_output *output_table_g;
 	struct precache_output *output_table_b;
+
+	/* parsed with ICC v4 support: LUT-only profiles are accepted and
+	 * transforms use the LUTs when present */
+	bool iccv4;
+
+	int ref_count;
 };
 
 #ifdef _MSC_VER
@@ -257,6 +267,14 @@ void precache_release(struct precache_output *p);
 qcms_bool set_rgb_colorants(qcms_profile *profile, qcms_CIE_xyY white_point, qcms_CIE_xyYTRIPLE primaries);
 qcms_bool get_rgb_colorants(struct matrix *colorants, qcms_CIE_xyY white_point, qcms_CIE_xyYTRIPLE primaries);
 
+void qcms_transform_data_rgb_out_lut_avx2(qcms_transform *transform,
+                                          unsigned char *src,
+                                          unsigned char *dest,
+                                          size_t length);
+void qcms_transform_data_rgba_out_lut_avx2(qcms_transform *transform,
+                                          unsigned char *src,
+                                          unsigned char *dest,
+                                          size_t length);
 void qcms_transform_data_rgb_out_lut_sse2(qcms_transform *transform,
                                           unsigned char *src,
                                           unsigned char *dest,
@@ -265,6 +283,14 @@ void qcms_transform_data_rgba_out_lut_sse2(qcms_transform *transform,
                                           unsigned char *src,
                                           unsigned char *dest,
                                           size_t length);
+void qcms_transform_data_tetra_clut_sse2(qcms_transform *transform,
+                                         unsigned char *src,
+                                         unsigned char *dest,
+                                         size_t length);
+void qcms_transform_data_tetra_clut_rgba_sse2(qcms_transform *transform,
+                                              unsigned char *src,
+                                              unsigned char *dest,
+                                              size_t length);
 void qcms_transform_data_rgb_out_lut_sse1(qcms_transform *transform,
                                           unsigned char *src,
                                           unsigned char *dest,
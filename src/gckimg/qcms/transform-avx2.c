@@ -0,0 +1,155 @@
+#include <immintrin.h>
+
+#include "qcmsint.h"
+
+/* The AVX2 kernels transform 8 pixels per iteration with the channels in
+ * separate registers, and look up both the input gamma tables and the output
+ * tables with gathers (the output tables are padded so a 32-bit gather at
+ * any index stays in bounds). The arithmetic is done in the same order as
+ * the SSE2 kernels, and without FMA, so the result is bit-identical whichever
+ * kernel a host ends up with. Leftover pixels are handed to the SSE2
+ * kernels. */
+
+#define FLOATSCALE  (float)(PRECACHE_OUTPUT_SIZE)
+#define CLAMPMAXVAL ( ((float) (PRECACHE_OUTPUT_SIZE - 1)) / PRECACHE_OUTPUT_SIZE )
+
+#define AVX2_TARGET __attribute__((target("avx2")))
+
+/* applies matrix column c to (r, g, b) and looks the result up in the
+ * output table; the byte ends up in the low 8 bits of each element */
+static inline AVX2_TARGET __m256i
+transform_channel(__m256 r, __m256 g, __m256 b, float (*mat)[4], int c,
+                  const uint8_t *otdata)
+{
+    const __m256 max   = _mm256_set1_ps(CLAMPMAXVAL);
+    const __m256 min   = _mm256_setzero_ps();
+    const __m256 scale = _mm256_set1_ps(FLOATSCALE);
+
+    __m256 vec_r = _mm256_mul_ps(r, _mm256_set1_ps(mat[0][c]));
+    __m256 vec_g = _mm256_mul_ps(g, _mm256_set1_ps(mat[1][c]));
+    __m256 vec_b = _mm256_mul_ps(b, _mm256_set1_ps(mat[2][c]));
+
+    vec_r = _mm256_add_ps(vec_r, _mm256_add_ps(vec_g, vec_b));
+    vec_r = _mm256_max_ps(min, vec_r);
+    vec_r = _mm256_min_ps(max, vec_r);
+
+    return _mm256_i32gather_epi32((const int *)otdata,
+                                  _mm256_cvtps_epi32(_mm256_mul_ps(vec_r, scale)), 1);
+}
+
+/* packs the output channels into one pixel per 32-bit element, in memory
+ * order */
+static inline AVX2_TARGET __m256i
+pack_pixels(__m256i r, __m256i g, __m256i b, __m256i a)
+{
+    const __m256i mask = _mm256_set1_epi32(0xff);
+
+    r = _mm256_slli_epi32(_mm256_and_si256(r, mask), OUTPUT_R_INDEX * 8);
+    g = _mm256_slli_epi32(_mm256_and_si256(g, mask), OUTPUT_G_INDEX * 8);
+    b = _mm256_slli_epi32(_mm256_and_si256(b, mask), OUTPUT_B_INDEX * 8);
+    return _mm256_or_si256(_mm256_or_si256(r, g), _mm256_or_si256(b, a));
+}
+
+AVX2_TARGET
+void qcms_transform_data_rgb_out_lut_avx2(qcms_transform *transform,
+                                          unsigned char *src,
+                                          unsigned char *dest,
+                                          size_t length)
+{
+    float (*mat)[4] = transform->matrix;
+
+    const float *igtbl_r = transform->input_gamma_table_r;
+    const float *igtbl_g = transform->input_gamma_table_g;
+    const float *igtbl_b = transform->input_gamma_table_b;
+
+    const uint8_t *otdata_r = &transform->output_table_r->data[0];
+    const uint8_t *otdata_g = &transform->output_table_g->data[0];
+    const uint8_t *otdata_b = &transform->output_table_b->data[0];
+
+    /* within each 128-bit lane, spread 4 packed RGB pixels out to one
+     * channel per 32-bit element, and back */
+    const __m256i shuf_r = _mm256_setr_epi8(
+        0, -1, -1, -1, 3, -1, -1, -1, 6, -1, -1, -1, 9, -1, -1, -1,
+        0, -1, -1, -1, 3, -1, -1, -1, 6, -1, -1, -1, 9, -1, -1, -1);
+    const __m256i shuf_g = _mm256_setr_epi8(
+        1, -1, -1, -1, 4, -1, -1, -1, 7, -1, -1, -1, 10, -1, -1, -1,
+        1, -1, -1, -1, 4, -1, -1, -1, 7, -1, -1, -1, 10, -1, -1, -1);
+    const __m256i shuf_b = _mm256_setr_epi8(
+        2, -1, -1, -1, 5, -1, -1, -1, 8, -1, -1, -1, 11, -1, -1, -1,
+        2, -1, -1, -1, 5, -1, -1, -1, 8, -1, -1, -1, 11, -1, -1, -1);
+    const __m256i shuf_pack = _mm256_setr_epi8(
+        0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+        0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+
+    while (length >= 8) {
+        /* load exactly 24 bytes: pixels 0-3 in the low lane, 4-7 in the high */
+        __m128i lo = _mm_loadu_si128((const __m128i*)src);
+        __m128i hi = _mm_loadl_epi64((const __m128i*)(src + 16));
+        __m256i px = _mm256_inserti128_si256(_mm256_castsi128_si256(lo),
+                                             _mm_alignr_epi8(hi, lo, 12), 1);
+
+        __m256 vec_r = _mm256_i32gather_ps(igtbl_r, _mm256_shuffle_epi8(px, shuf_r), 4);
+        __m256 vec_g = _mm256_i32gather_ps(igtbl_g, _mm256_shuffle_epi8(px, shuf_g), 4);
+        __m256 vec_b = _mm256_i32gather_ps(igtbl_b, _mm256_shuffle_epi8(px, shuf_b), 4);
+
+        __m256i out = pack_pixels(transform_channel(vec_r, vec_g, vec_b, mat, 0, otdata_r),
+                                  transform_channel(vec_r, vec_g, vec_b, mat, 1, otdata_g),
+                                  transform_channel(vec_r, vec_g, vec_b, mat, 2, otdata_b),
+                                  _mm256_setzero_si256());
+
+        /* store exactly 24 bytes */
+        out = _mm256_shuffle_epi8(out, shuf_pack);
+        lo = _mm256_castsi256_si128(out);
+        hi = _mm256_extracti128_si256(out, 1);
+        _mm_storeu_si128((__m128i*)dest, _mm_or_si128(lo, _mm_slli_si128(hi, 12)));
+        _mm_storel_epi64((__m128i*)(dest + 16), _mm_srli_si128(hi, 4));
+
+        src += 8 * 3;
+        dest += 8 * RGB_OUTPUT_COMPONENTS;
+        length -= 8;
+    }
+
+    if (length)
+        qcms_transform_data_rgb_out_lut_sse2(transform, src, dest, length);
+}
+
+AVX2_TARGET
+void qcms_transform_data_rgba_out_lut_avx2(qcms_transform *transform,
+                                           unsigned char *src,
+                                           unsigned char *dest,
+                                           size_t length)
+{
+    float (*mat)[4] = transform->matrix;
+
+    const float *igtbl_r = transform->input_gamma_table_r;
+    const float *igtbl_g = transform->input_gamma_table_g;
+    const float *igtbl_b = transform->input_gamma_table_b;
+
+    const uint8_t *otdata_r = &transform->output_table_r->data[0];
+    const uint8_t *otdata_g = &transform->output_table_g->data[0];
+    const uint8_t *otdata_b = &transform->output_table_b->data[0];
+
+    const __m256i mask = _mm256_set1_epi32(0xff);
+
+    while (length >= 8) {
+        __m256i px = _mm256_loadu_si256((const __m256i*)src);
+
+        __m256 vec_r = _mm256_i32gather_ps(igtbl_r, _mm256_and_si256(px, mask), 4);
+        __m256 vec_g = _mm256_i32gather_ps(igtbl_g, _mm256_and_si256(_mm256_srli_epi32(px, 8), mask), 4);
+        __m256 vec_b = _mm256_i32gather_ps(igtbl_b, _mm256_and_si256(_mm256_srli_epi32(px, 16), mask), 4);
+        __m256i alpha = _mm256_slli_epi32(_mm256_srli_epi32(px, 24), OUTPUT_A_INDEX * 8);
+
+        _mm256_storeu_si256((__m256i*)dest,
+                            pack_pixels(transform_channel(vec_r, vec_g, vec_b, mat, 0, otdata_r),
+                                        transform_channel(vec_r, vec_g, vec_b, mat, 1, otdata_g),
+                                        transform_channel(vec_r, vec_g, vec_b, mat, 2, otdata_b),
+                                        alpha));
+
+        src += 8 * 4;
+        dest += 8 * RGBA_OUTPUT_COMPONENTS;
+        length -= 8;
+    }
+
+    if (length)
+        qcms_transform_data_rgba_out_lut_sse2(transform, src, dest, length);
+}
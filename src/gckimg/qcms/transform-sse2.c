@@ -241,3 +241,126 @@ void qcms_transform_data_rgba_out_lut_sse2(qcms_transform *transform,
 }
 
 
+
+/* Tetrahedral CLUT interpolation, vectorized across the output channels:
+ * the CLUT is interleaved r, g, b, so each grid point is one unaligned load
+ * (the allocation is padded by a float for the last one). The arithmetic
+ * matches qcms_transform_data_tetra_clut step for step, so the results are
+ * identical. */
+static inline __m128 tetra_clut_sse2(const float *clut, int grid_size,
+                                     unsigned char in_r,
+                                     unsigned char in_g,
+                                     unsigned char in_b)
+{
+    const int len = grid_size * grid_size;
+    const int x_len = grid_size;
+    float linear_r = in_r/255.0f, linear_g = in_g/255.0f, linear_b = in_b/255.0f;
+
+    int x = in_r * (grid_size-1) / 255;
+    int y = in_g * (grid_size-1) / 255;
+    int z = in_b * (grid_size-1) / 255;
+    int x_n = (in_r * (grid_size-1) + 254) / 255;
+    int y_n = (in_g * (grid_size-1) + 254) / 255;
+    int z_n = (in_b * (grid_size-1) + 254) / 255;
+    float rx = linear_r * (grid_size-1) - x;
+    float ry = linear_g * (grid_size-1) - y;
+    float rz = linear_b * (grid_size-1) - z;
+
+#define CLU_PS(x, y, z) _mm_loadu_ps(&clut[((x)*len + (y)*x_len + (z))*3])
+    __m128 c0 = CLU_PS(x, y, z);
+    __m128 c1, c2, c3;
+
+    if (rx >= ry) {
+        if (ry >= rz) { //rx >= ry && ry >= rz
+            c1 = _mm_sub_ps(CLU_PS(x_n, y, z), c0);
+            c2 = _mm_sub_ps(CLU_PS(x_n, y_n, z), CLU_PS(x_n, y, z));
+            c3 = _mm_sub_ps(CLU_PS(x_n, y_n, z_n), CLU_PS(x_n, y_n, z));
+        } else if (rx >= rz) { //rx >= rz && rz >= ry
+            c1 = _mm_sub_ps(CLU_PS(x_n, y, z), c0);
+            c2 = _mm_sub_ps(CLU_PS(x_n, y_n, z_n), CLU_PS(x_n, y, z_n));
+            c3 = _mm_sub_ps(CLU_PS(x_n, y, z_n), CLU_PS(x_n, y, z));
+        } else { //rz > rx && rx >= ry
+            c1 = _mm_sub_ps(CLU_PS(x_n, y, z_n), CLU_PS(x, y, z_n));
+            c2 = _mm_sub_ps(CLU_PS(x_n, y_n, z_n), CLU_PS(x_n, y, z_n));
+            c3 = _mm_sub_ps(CLU_PS(x, y, z_n), c0);
+        }
+    } else {
+        if (rx >= rz) { //ry > rx && rx >= rz
+            c1 = _mm_sub_ps(CLU_PS(x_n, y_n, z), CLU_PS(x, y_n, z));
+            c2 = _mm_sub_ps(CLU_PS(x, y_n, z), c0);
+            c3 = _mm_sub_ps(CLU_PS(x_n, y_n, z_n), CLU_PS(x_n, y_n, z));
+        } else if (ry >= rz) { //ry >= rz && rz > rx
+            c1 = _mm_sub_ps(CLU_PS(x_n, y_n, z_n), CLU_PS(x, y_n, z_n));
+            c2 = _mm_sub_ps(CLU_PS(x, y_n, z), c0);
+            c3 = _mm_sub_ps(CLU_PS(x, y_n, z_n), CLU_PS(x, y_n, z));
+        } else { //rz > ry && ry > rx
+            c1 = _mm_sub_ps(CLU_PS(x_n, y_n, z_n), CLU_PS(x, y_n, z_n));
+            c2 = _mm_sub_ps(CLU_PS(x, y_n, z_n), CLU_PS(x, y, z_n));
+            c3 = _mm_sub_ps(CLU_PS(x, y, z_n), c0);
+        }
+    }
+#undef CLU_PS
+
+    c0 = _mm_add_ps(c0, _mm_mul_ps(c1, _mm_set1_ps(rx)));
+    c0 = _mm_add_ps(c0, _mm_mul_ps(c2, _mm_set1_ps(ry)));
+    c0 = _mm_add_ps(c0, _mm_mul_ps(c3, _mm_set1_ps(rz)));
+    return c0;
+}
+
+/* clamp_u8(v*255) for each channel, packed into the low bytes of an int
+ * in r, g, b order */
+static inline uint32_t clamp_pack_u8_sse2(__m128 v)
+{
+    __m128i out;
+
+    v = _mm_mul_ps(v, _mm_set1_ps(255.0f));
+    v = _mm_min_ps(v, _mm_set1_ps(255.0f));
+    v = _mm_max_ps(v, _mm_setzero_ps());
+    /* v is non-negative, so truncating v + .5 is the same as floorf */
+    out = _mm_cvttps_epi32(_mm_add_ps(v, _mm_set1_ps(0.5f)));
+    out = _mm_packs_epi32(out, out);
+    out = _mm_packus_epi16(out, out);
+    return (uint32_t)_mm_cvtsi128_si32(out);
+}
+
+void qcms_transform_data_tetra_clut_sse2(qcms_transform *transform,
+                                         unsigned char *src,
+                                         unsigned char *dest,
+                                         size_t length)
+{
+    size_t i;
+    const float *clut = transform->r_clut;
+    int grid_size = transform->grid_size;
+
+    for (i = 0; i < length; i++) {
+        uint32_t rgb = clamp_pack_u8_sse2(tetra_clut_sse2(clut, grid_size, src[0], src[1], src[2]));
+        src += 3;
+
+        dest[OUTPUT_R_INDEX] = rgb;
+        dest[OUTPUT_G_INDEX] = rgb >> 8;
+        dest[OUTPUT_B_INDEX] = rgb >> 16;
+        dest += RGB_OUTPUT_COMPONENTS;
+    }
+}
+
+void qcms_transform_data_tetra_clut_rgba_sse2(qcms_transform *transform,
+                                              unsigned char *src,
+                                              unsigned char *dest,
+                                              size_t length)
+{
+    size_t i;
+    const float *clut = transform->r_clut;
+    int grid_size = transform->grid_size;
+
+    for (i = 0; i < length; i++) {
+        uint32_t rgb = clamp_pack_u8_sse2(tetra_clut_sse2(clut, grid_size, src[0], src[1], src[2]));
+        unsigned char in_a = src[3];
+        src += 4;
+
+        dest[OUTPUT_R_INDEX] = rgb;
+        dest[OUTPUT_G_INDEX] = rgb >> 8;
+        dest[OUTPUT_B_INDEX] = rgb >> 16;
+        dest[OUTPUT_A_INDEX] = in_a;
+        dest += RGBA_OUTPUT_COMPONENTS;
+    }
+}
@@ -933,6 +933,7 @@ static qcms_transform *transform_alloc(void)
 		/* Doing a memset to initialise all bits to 'zero'*/
 		memset(allocated_memory, 0, sizeof(qcms_transform));
 		t = allocated_memory;
+		t->ref_count = 1;
 		return t;
 	} else {
 		return NULL;
@@ -959,6 +960,7 @@ static qcms_transform *transform_alloc(void)
 	original_block_ptr--;
 	*original_block_ptr = original_block;
 
+	transform_aligned->ref_count = 1;
 	return transform_aligned;
 }
 static void transform_free(qcms_transform *t)
@@ -970,8 +972,17 @@ static void transform_free(qcms_transform *t)
 }
 #endif
 
+qcms_transform *qcms_transform_reference(qcms_transform *t)
+{
+	qcms_atomic_increment(t->ref_count);
+	return t;
+}
+
 void qcms_transform_release(qcms_transform *t)
 {
+	if (qcms_atomic_decrement(t->ref_count) != 0)
+		return;
+
 	/* ensure we only free the gamma tables once even if there are
 	 * multiple references to the same data */
 
@@ -1081,6 +1092,21 @@ static int sse_version_available(void)
 	return 0;
 #endif
 }
+
+#if defined(__GNUC__)
+#define HAS_AVX2_KERNELS
+static int avx2_available(void)
+{
+	static __thread int avx2 = -1;
+
+	if (avx2 == -1) {
+		__builtin_cpu_init();
+		avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+	}
+
+	return avx2;
+}
+#endif
 #endif
 
 static const struct matrix bradford_matrix = {{	{ 0.8951f, 0.2664f,-0.1614f},
@@ -1111,7 +1137,7 @@ void qcms_profile_precache_output_transform(qcms_profile *profile)
 	if (profile->color_space != RGB_SIGNATURE)
 		return;
 
-	if (qcms_supports_iccv4) {
+	if (qcms_supports_iccv4 || profile->iccv4) {
 		/* don't precache since we will use the B2A LUT */
 		if (profile->B2A0)
 			return;
@@ -1152,6 +1178,23 @@ void qcms_profile_precache_output_transform(qcms_profile *profile)
 }
 
 /* Replace the current transformation with a LUT transformation using a given number of sample points */
+static void set_tetra_clut_fn(qcms_transform *transform, qcms_data_type in_type)
+{
+#ifdef X86
+	if (sse_version_available() >= 2) {
+		if (in_type == QCMS_DATA_RGBA_8)
+			transform->transform_fn = qcms_transform_data_tetra_clut_rgba_sse2;
+		else
+			transform->transform_fn = qcms_transform_data_tetra_clut_sse2;
+	} else
+#endif
+	if (in_type == QCMS_DATA_RGBA_8) {
+		transform->transform_fn = qcms_transform_data_tetra_clut_rgba;
+	} else {
+		transform->transform_fn = qcms_transform_data_tetra_clut;
+	}
+}
+
 qcms_transform* qcms_transform_precacheLUT_float(qcms_transform *transform, qcms_profile *in, qcms_profile *out, 
                                                  int samples, qcms_data_type in_type)
 {
@@ -1163,10 +1206,15 @@ qcms_transform* qcms_transform_precacheLUT_float(qcms_transform *transform, qcms
 	float* dest = NULL;
 	float* lut = NULL;
 
-	src = malloc(lutSize*sizeof(float));
-	dest = malloc(lutSize*sizeof(float));
+	/* Either buffer may end up as the CLUT. The extra float lets the SSE2
+	 * kernels load the r, g, b of the last grid point as one vector. */
+	src = malloc((lutSize + 1)*sizeof(float));
+	dest = malloc((lutSize + 1)*sizeof(float));
 
 	if (src && dest) {
+		/* The extra float is only loaded, never used; keep it defined. */
+		src[lutSize] = dest[lutSize] = 0;
+
 		/* Prepare a list of points we want to sample */
 		l = 0;
 		for (x = 0; x < samples; x++) {
@@ -1185,11 +1233,7 @@ qcms_transform* qcms_transform_precacheLUT_float(qcms_transform *transform, qcms
 			transform->g_clut = &lut[1];
 			transform->b_clut = &lut[2];
 			transform->grid_size = samples;
-			if (in_type == QCMS_DATA_RGBA_8) {
-				transform->transform_fn = qcms_transform_data_tetra_clut_rgba;
-			} else {
-				transform->transform_fn = qcms_transform_data_tetra_clut;
-			}
+			set_tetra_clut_fn(transform, in_type);
 		}
 	}
 
@@ -1209,6 +1253,44 @@ qcms_transform* qcms_transform_precacheLUT_float(qcms_transform *transform, qcms
 	return transform;
 }
 
+const float *qcms_transform_get_clut(qcms_transform *transform, int *grid_size)
+{
+	if (!transform->r_clut)
+		return NULL;
+	*grid_size = transform->grid_size;
+	return transform->r_clut;
+}
+
+qcms_transform* qcms_transform_create_from_clut(const float *clut, int grid_size, qcms_data_type in_type)
+{
+	size_t lut_size = 3 * (size_t)grid_size * grid_size * grid_size;
+	qcms_transform *transform;
+	float *lut;
+
+	if (grid_size < 2 || (in_type != QCMS_DATA_RGB_8 && in_type != QCMS_DATA_RGBA_8))
+		return NULL;
+
+	transform = transform_alloc();
+	if (!transform)
+		return NULL;
+
+	/* padded like the buffers in qcms_transform_precacheLUT_float */
+	lut = malloc((lut_size + 1)*sizeof(float));
+	if (!lut) {
+		qcms_transform_release(transform);
+		return NULL;
+	}
+	memcpy(lut, clut, lut_size*sizeof(float));
+	lut[lut_size] = 0;
+
+	transform->r_clut = &lut[0];
+	transform->g_clut = &lut[1];
+	transform->b_clut = &lut[2];
+	transform->grid_size = grid_size;
+	set_tetra_clut_fn(transform, in_type);
+	return transform;
+}
+
 #define NO_MEM_TRANSFORM NULL
 
 qcms_transform* qcms_transform_create(
@@ -1238,7 +1320,7 @@ qcms_transform* qcms_transform_create(
 	}
 
 	// This precache assumes RGB_SIGNATURE (fails on GRAY_SIGNATURE, for instance)
-	if (qcms_supports_iccv4 &&
+	if ((qcms_supports_iccv4 || in->iccv4 || out->iccv4) &&
 			(in_type == QCMS_DATA_RGB_8 || in_type == QCMS_DATA_RGBA_8) &&
 			(in->A2B0 || out->B2A0 || in->mAB || out->mAB))
 		{
@@ -1285,6 +1367,14 @@ qcms_transform* qcms_transform_create(
             	}
 		if (precache) {
 #ifdef X86
+#ifdef HAS_AVX2_KERNELS
+		    if (avx2_available()) {
+			    if (in_type == QCMS_DATA_RGB_8)
+				    transform->transform_fn = qcms_transform_data_rgb_out_lut_avx2;
+			    else
+				    transform->transform_fn = qcms_transform_data_rgba_out_lut_avx2;
+		    } else
+#endif
 		    if (sse_version_available() >= 2) {
 			    if (in_type == QCMS_DATA_RGB_8)
 				    transform->transform_fn = qcms_transform_data_rgb_out_lut_sse2;
@@ -1415,3 +1505,67 @@ void qcms_enable_iccv4()
 {
 	qcms_supports_iccv4 = true;
 }
+
+static bool colorant_match(struct XYZNumber a, struct XYZNumber b)
+{
+	const float tolerance = 0.002f;
+	return fabsf(s15Fixed16Number_to_float(a.X) - s15Fixed16Number_to_float(b.X)) <= tolerance &&
+	       fabsf(s15Fixed16Number_to_float(a.Y) - s15Fixed16Number_to_float(b.Y)) <= tolerance &&
+	       fabsf(s15Fixed16Number_to_float(a.Z) - s15Fixed16Number_to_float(b.Z)) <= tolerance;
+}
+
+/* Compares the curves where they are sampled by 8-bit input, allowing each
+ * linear value of 'a' to be off from 'b' by up to half a code value at the
+ * local slope of 'b'. */
+static bool trc_match(struct curveType *a, struct curveType *b)
+{
+	float *table_a, *table_b;
+	bool match = true;
+	int i;
+
+	table_a = build_input_gamma_table(a);
+	table_b = build_input_gamma_table(b);
+	if (!table_a || !table_b) {
+		match = false;
+	} else {
+		for (i = 0; i < 256 && match; i++) {
+			float lo = table_b[i > 0 ? i - 1 : 0];
+			float hi = table_b[i < 255 ? i + 1 : 255];
+			float half_step = (hi - lo) / (i > 0 && i < 255 ? 4.f : 2.f);
+			if (fabsf(table_a[i] - table_b[i]) > half_step + 1e-6f)
+				match = false;
+		}
+	}
+	free(table_a);
+	free(table_b);
+	return match;
+}
+
+/* Returns true if a transform between the two profiles would be the identity
+ * to within rounding, i.e. both are matrix/TRC RGB profiles with matching
+ * colorants and tone curves. The white points are covered by the colorants:
+ * those are adapted to the D50 PCS and sum to the profile's white. */
+qcms_bool qcms_profile_match(qcms_profile *a, qcms_profile *b)
+{
+	if (a == b)
+		return true;
+
+	if (a->color_space != RGB_SIGNATURE || b->color_space != RGB_SIGNATURE)
+		return false;
+
+	/* Mirror qcms_transform_create: LUT based profiles take the CLUT path */
+	if ((qcms_supports_iccv4 || a->iccv4 || b->iccv4) &&
+	    (a->A2B0 || a->mAB || b->B2A0 || b->mAB))
+		return false;
+
+	if (!a->redTRC || !a->greenTRC || !a->blueTRC ||
+	    !b->redTRC || !b->greenTRC || !b->blueTRC)
+		return false;
+
+	return colorant_match(a->redColorant, b->redColorant) &&
+	       colorant_match(a->greenColorant, b->greenColorant) &&
+	       colorant_match(a->blueColorant, b->blueColorant) &&
+	       trc_match(a->redTRC, b->redTRC) &&
+	       trc_match(a->greenTRC, b->greenTRC) &&
+	       trc_match(a->blueTRC, b->blueTRC);
+}
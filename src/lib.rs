@@ -14,6 +14,7 @@ use std::os::raw::{c_void};
 use std::slice::{from_raw_parts};
 use std::str::{from_utf8};
 
+pub mod batch;
 pub mod color;
 pub mod decoders;
 pub mod exif;
@@ -27,6 +28,19 @@ pub const PNG_MAGICNUM:     [u8; 8] = [0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a, 0x1a,
 pub const TIFF_MAGICNUM:    [u8; 4] = [b'I', b'I', b'*',    0];
 pub const TIFFB_MAGICNUM:   [u8; 4] = [b'M', b'M',    0, b'*'];
 
+/// The pixel layouts a writer can store, for `ImageWriterCallbacks`'
+/// `pixel_format` (`ImagePixelFormat` in image.h). The decoders produce rows
+/// in it, so they can go straight into the writer's raster. In the 4-byte
+/// layouts, X is the alpha of images that have it and 0xff otherwise.
+#[derive(Clone, Copy, PartialEq, Eq, Debug)]
+pub enum PixelFormat {
+  Rgbx = 0,
+  Bgrx = 1,
+  Xrgb = 2,
+  Xbgr = 3,
+  Rgb  = 4,
+}
+
 pub trait ImageWriter {
   fn callbacks() -> ImageWriterCallbacks;
 }
@@ -92,6 +106,20 @@ pub unsafe extern "C" fn color_image_write_row_rgbx(img_p: *mut c_void, row_idx:
   img.inner.as_mut().unwrap().raster_line_mut(row_idx as _).copy_from_slice(row);
 }
 
+pub unsafe extern "C" fn color_image_write_rows_rgbx(img_p: *mut c_void, row_idx: usize, num_rows: usize, rows_buf: *const u8, row_stride: usize, row_width: usize) {
+  for r in 0 .. num_rows {
+    color_image_write_row_rgbx(img_p, row_idx + r, rows_buf.offset((r * row_stride) as isize), row_width);
+  }
+}
+
+pub unsafe extern "C" fn color_image_get_row_buffer(img_p: *mut c_void, row_idx: usize) -> *mut u8 {
+  assert!(!img_p.is_null());
+  let img = &mut *(img_p as *mut ColorImage);
+
+  assert!(img.inner.is_some());
+  img.inner.as_mut().unwrap().raster_line_mut(row_idx as _).as_mut_ptr()
+}
+
 pub unsafe extern "C" fn color_image_parse_exif(img_p: *mut c_void, exif_buf: *const u8, exif_size: usize) -> i32 {
   assert!(!img_p.is_null());
   let img = &mut *(img_p as *mut ColorImage);
@@ -114,7 +142,10 @@ impl ImageWriter for ColorImage {
       write_row_grayx:  Some(color_image_write_row_grayx),
       write_row_rgb:    Some(color_image_write_row_rgb),
       write_row_rgbx:   Some(color_image_write_row_rgbx),
+      write_rows_rgbx:  Some(color_image_write_rows_rgbx),
+      get_row_buffer:   Some(color_image_get_row_buffer),
       parse_exif:       Some(color_image_parse_exif),
+      pixel_format:     PixelFormat::Rgbx as _,
     }
   }
 }
@@ -138,6 +169,74 @@ impl ColorImage {
       })
   }
 
+  /// Like `decode`, trading quality for speed as `opts` says.
+  pub fn decode_with_options(buf: &[u8], opts: DecodeOptions) -> Result<Self, ()> {
+    let mut image = ColorImage::new();
+    decode_image_with_options(buf, &mut image, opts)
+      .map(|_| image)
+  }
+
+  /// Like `decode`, for callers that will shrink the image to fit in
+  /// `width` x `height`: JPEGs are decoded at the smallest DCT scale, and
+  /// interlaced PNGs at the smallest Adam7 pass scale, whose result is still
+  /// at least that large, leaving `resize` to finish the remainder.
+  /// Non-interlaced PNGs are decoded at full size; other formats fail.
+  pub fn decode_with_max_size(buf: &[u8], width: usize, height: usize) -> Result<Self, ()> {
+    let mut image = ColorImage::new();
+    match guess_image_format_from_magicnum(buf) {
+      Some(ImageFormat::Jpeg) => {
+        NSJpegDecoder::new(true)
+          .with_target_size(width, height)
+          .decode(buf, &mut image)
+      }
+      Some(ImageFormat::Png) => {
+        NSPngDecoder::new(true)
+          .with_target_size(width, height)
+          .decode(buf, &mut image)
+      }
+      _ => Err(()),
+    }.map(|_| image)
+  }
+
+  /// Decode only the `width` x `height` window at (`x`, `y`). JPEGs skip the
+  /// rows outside of it and only decode the iMCU columns that cover it;
+  /// PNGs are decoded in full and then cropped. Other formats fail.
+  pub fn decode_region(buf: &[u8], x: usize, y: usize, width: usize, height: usize) -> Result<Self, ()> {
+    let mut image = ColorImage::new();
+    match guess_image_format_from_magicnum(buf) {
+      Some(ImageFormat::Jpeg) => {
+        NSJpegDecoder::new(true)
+          .with_region(x, y, width, height)
+          .decode(buf, &mut image)
+      }
+      Some(ImageFormat::Png) => match NSPngDecoder::new(true).decode(buf, &mut image) {
+        Err(e) => Err(e),
+        Ok(_) if width == 0 || height == 0 ||
+                 x.checked_add(width).map_or(true, |x_end| x_end > image.width()) ||
+                 y.checked_add(height).map_or(true, |y_end| y_end > image.height()) => Err(()),
+        Ok(_) => {
+          image.crop(x, y, width, height);
+          Ok(())
+        }
+      },
+      _ => Err(()),
+    }.map(|_| image)
+  }
+
+  /// Copy in a raster of packed RGBX rows. The batch decoder uses this to
+  /// turn its workers' rasters into images on the calling thread.
+  fn from_rgbx(width: usize, height: usize, data: &[u8], exif_rot: Option<i32>) -> Self {
+    assert_eq!(data.len(), 4 * width * height);
+    let mut inner = unsafe { PILImage::new(PILMode::RGB, width as _, height as _) };
+    for row_idx in 0 .. height {
+      inner.raster_line_mut(row_idx as _).copy_from_slice(&data[4 * width * row_idx .. 4 * width * (row_idx + 1)]);
+    }
+    ColorImage{
+      inner:    Some(inner),
+      exif_rot: exif_rot,
+    }
+  }
+
   pub fn exif_orientation_code(&self) -> Option<i32> {
     self.exif_rot
   }
@@ -271,6 +370,18 @@ pub unsafe extern "C" fn raster_image_write_row_rgbx(img_p: *mut c_void, row_idx
   }
 }
 
+pub unsafe extern "C" fn raster_image_write_rows_rgbx(img_p: *mut c_void, row_idx: usize, num_rows: usize, rows_buf: *const u8, row_stride: usize, row_width: usize) {
+  for r in 0 .. num_rows {
+    raster_image_write_row_rgbx(img_p, row_idx + r, rows_buf.offset((r * row_stride) as isize), row_width);
+  }
+}
+
+pub unsafe extern "C" fn raster_image_get_row_buffer(img_p: *mut c_void, row_idx: usize) -> *mut u8 {
+  assert!(!img_p.is_null());
+  let img = &mut *(img_p as *mut RasterImage);
+  img.data[row_idx].as_mut_ptr()
+}
+
 impl ImageWriter for RasterImage {
   fn callbacks() -> ImageWriterCallbacks {
     ImageWriterCallbacks{
@@ -279,7 +390,11 @@ impl ImageWriter for RasterImage {
       write_row_grayx:  Some(raster_image_write_row_grayx),
       write_row_rgb:    Some(raster_image_write_row_rgb),
       write_row_rgbx:   Some(raster_image_write_row_rgbx),
+      write_rows_rgbx:  Some(raster_image_write_rows_rgbx),
+      get_row_buffer:   Some(raster_image_get_row_buffer),
       parse_exif:       Some(generic_parse_exif),
+      // Rows are stored as packed RGB.
+      pixel_format:     PixelFormat::Rgb as _,
     }
   }
 }
@@ -301,6 +416,11 @@ impl RasterImage {
   pub fn height(&self) -> usize {
     self.height
   }
+
+  /// A row of packed RGB pixels.
+  pub fn raster_line(&self, row_idx: usize) -> &[u8] {
+    &self.data[row_idx]
+  }
 }
 
 #[derive(Clone, Copy, PartialEq, Eq, Hash, Debug)]
@@ -313,17 +433,17 @@ pub enum ImageFormat {
 }
 
 pub fn guess_image_format_from_magicnum(buf: &[u8]) -> Option<ImageFormat> {
-  if &buf[ .. 3] == &JPEG_MAGICNUM {
+  if buf.starts_with(&JPEG_MAGICNUM) {
     return Some(ImageFormat::Jpeg);
-  } else if &buf[ .. 8] == &PNG_MAGICNUM {
+  } else if buf.starts_with(&PNG_MAGICNUM) {
     return Some(ImageFormat::Png);
-  } else if &buf[ .. 6] == &GIF89A_MAGICNUM ||
-            &buf[ .. 6] == &GIF87A_MAGICNUM {
+  } else if buf.starts_with(&GIF89A_MAGICNUM) ||
+            buf.starts_with(&GIF87A_MAGICNUM) {
     return Some(ImageFormat::Gif);
-  } else if &buf[ .. 2] == &BMP_MAGICNUM {
+  } else if buf.starts_with(&BMP_MAGICNUM) {
     return Some(ImageFormat::Bmp);
-  } else if &buf[ .. 4] == &TIFF_MAGICNUM ||
-            &buf[ .. 4] == &TIFFB_MAGICNUM {
+  } else if buf.starts_with(&TIFF_MAGICNUM) ||
+            buf.starts_with(&TIFFB_MAGICNUM) {
     return Some(ImageFormat::Tiff);
   } else {
     println!("DEBUG: colorimage: unknown magicnum: {:?}", &buf[ .. 10.min(buf.len())]);
@@ -331,6 +451,52 @@ pub fn guess_image_format_from_magicnum(buf: &[u8]) -> Option<ImageFormat> {
   None
 }
 
+/// Like `guess_image_format_from_magicnum`, for the formats that have a
+/// decoder, and quietly.
+fn decodable_image_format(buf: &[u8]) -> Option<ImageFormat> {
+  if buf.starts_with(&JPEG_MAGICNUM) {
+    Some(ImageFormat::Jpeg)
+  } else if buf.starts_with(&PNG_MAGICNUM) {
+    Some(ImageFormat::Png)
+  } else {
+    None
+  }
+}
+
+/// What `probe_image` finds in an image's header.
+#[derive(Clone, Debug)]
+pub struct ImageInfo {
+  pub format:     ImageFormat,
+  pub width:      usize,
+  pub height:     usize,
+  /// Bits per sample, as stored.
+  pub bit_depth:  usize,
+  /// Samples per pixel, as stored; palette PNGs count as RGB.
+  pub channels:   usize,
+  /// Whether there is an alpha channel or (PNG) a tRNS chunk.
+  pub has_alpha:  bool,
+  /// Whether the image is a progressive JPEG or an interlaced PNG.
+  pub progressive:  bool,
+  /// Whether there is an embedded ICC profile.
+  pub has_icc:    bool,
+  /// The EXIF orientation code (1-8), if there is one.
+  pub exif_orientation: Option<i32>,
+  pub jpeg_color_space: Option<JpegColorSpace>,
+  /// For JPEGs, how many luma samples share a chroma sample, across and
+  /// down.
+  pub jpeg_subsampling: Option<(usize, usize)>,
+}
+
+/// Read an image's metadata from its header, without decoding any pixels or
+/// building a color transform. Only JPEG and PNG are supported.
+pub fn probe_image(buf: &[u8]) -> Result<ImageInfo, ()> {
+  match decodable_image_format(buf) {
+    Some(ImageFormat::Jpeg) => probe_jpeg(buf),
+    Some(ImageFormat::Png)  => probe_png(buf),
+    _ => Err(()),
+  }
+}
+
 pub fn decode_jpeg_image<W>(buf: &[u8], writer: &mut W) -> Result<(), ()> where W: ImageWriter + 'static {
   match NSJpegDecoder::new(true).decode(buf, writer) {
     Ok(_) => Ok(()),
@@ -346,32 +512,41 @@ pub fn decode_png_image<W>(buf: &[u8], writer: &mut W) -> Result<(), ()> where W
 }
 
 pub fn decode_image<W>(buf: &[u8], writer: &mut W) -> Result<(), ()> where W: ImageWriter + 'static {
+  decode_image_with_options(buf, writer, DecodeOptions::default())
+}
+
+pub fn decode_image_with_options<W>(buf: &[u8], writer: &mut W, opts: DecodeOptions) -> Result<(), ()> where W: ImageWriter + 'static {
+  let decode_jpeg = |buf: &[u8], writer: &mut W| {
+    NSJpegDecoder::new(true).with_options(opts).decode(buf, writer)
+  };
+  let decode_png = |buf: &[u8], writer: &mut W| {
+    NSPngDecoder::new(true).with_options(opts).decode(buf, writer)
+  };
   let maybe_format = guess_image_format_from_magicnum(buf);
-  let mut tried_formats = None;
+  let mut tried_formats = HashSet::new();
   if let Some(format) = maybe_format {
     let res = match format {
-      ImageFormat::Jpeg => decode_jpeg_image(buf, writer),
-      ImageFormat::Png  => decode_png_image(buf, writer),
-      // TODO
-      _ => unimplemented!(),
+      ImageFormat::Jpeg => decode_jpeg(buf, writer),
+      ImageFormat::Png  => decode_png(buf, writer),
+      // TODO: GIF, BMP and TIFF decoders.
+      _ => return Err(()),
     };
     if res.is_ok() {
       return Ok(());
     }
-    tried_formats = Some(HashSet::new());
-    tried_formats.as_mut().unwrap().insert(format);
+    tried_formats.insert(format);
   }
-  if !tried_formats.as_ref().unwrap().contains(&ImageFormat::Jpeg) {
-    if decode_jpeg_image(buf, writer).is_ok() {
+  if !tried_formats.contains(&ImageFormat::Jpeg) {
+    if decode_jpeg(buf, writer).is_ok() {
       return Ok(());
     }
-    tried_formats.as_mut().unwrap().insert(ImageFormat::Jpeg);
+    tried_formats.insert(ImageFormat::Jpeg);
   }
-  if !tried_formats.as_ref().unwrap().contains(&ImageFormat::Png) {
-    if decode_png_image(buf, writer).is_ok() {
+  if !tried_formats.contains(&ImageFormat::Png) {
+    if decode_png(buf, writer).is_ok() {
       return Ok(());
     }
-    tried_formats.as_mut().unwrap().insert(ImageFormat::Png);
+    tried_formats.insert(ImageFormat::Png);
   }
   // TODO
   Err(())
@@ -1,10 +1,19 @@
 extern crate colorimage;
 
 use colorimage::*;
+use colorimage::decoders::*;
+use colorimage::decoders::jpeg::*;
+use colorimage::decoders::png::*;
+
+use colorimage::ffi::gckimg::*;
 
 use std::fs::{File};
 use std::io::*;
+use std::marker::{PhantomData};
+use std::os::raw::{c_void};
 use std::path::{PathBuf};
+use std::ptr::{null_mut};
+use std::slice::{from_raw_parts};
 
 #[test]
 fn test_png() {
@@ -16,3 +25,570 @@ fn test_png() {
   let mut image = RasterImage::new();
   let _ = decode_png_image(&test_buf, &mut image);
 }
+
+fn read_test_file(name: &str) -> Vec<u8> {
+  let test_path = PathBuf::from("tests").join(name);
+  let mut test_file = File::open(&test_path).unwrap();
+  let mut test_buf = Vec::new();
+  test_file.read_to_end(&mut test_buf).unwrap();
+  test_buf
+}
+
+fn rgb_pixel(image: &ColorImage, x: usize, y: usize) -> &[u8] {
+  &image.raster_line(y)[4 * x .. 4 * x + 3]
+}
+
+fn assert_same_rgb(lhs: &ColorImage, rhs: &ColorImage) {
+  assert_eq!(lhs.width(), rhs.width());
+  assert_eq!(lhs.height(), rhs.height());
+  for y in 0 .. lhs.height() {
+    for x in 0 .. lhs.width() {
+      assert_eq!(rgb_pixel(lhs, x, y), rgb_pixel(rhs, x, y), "pixel ({}, {})", x, y);
+    }
+  }
+}
+
+/// The mean absolute difference over the RGB samples of two images of the
+/// same size.
+fn mean_abs_diff(lhs: &ColorImage, rhs: &ColorImage) -> f64 {
+  assert_eq!(lhs.width(), rhs.width());
+  assert_eq!(lhs.height(), rhs.height());
+  let mut sum = 0;
+  for y in 0 .. lhs.height() {
+    for x in 0 .. lhs.width() {
+      for (&l, &r) in rgb_pixel(lhs, x, y).iter().zip(rgb_pixel(rhs, x, y).iter()) {
+        sum += (l as i64 - r as i64).abs();
+      }
+    }
+  }
+  sum as f64 / (3 * lhs.width() * lhs.height()) as f64
+}
+
+const CHUNK_SIZES: [usize; 4] = [1, 7, 333, 4096];
+
+fn decode_jpeg_in_chunks(decoder: &mut NSJpegDecoder, buf: &[u8], chunk_size: usize) -> ColorImage {
+  let mut image = ColorImage::new();
+  {
+    let mut stream = decoder.begin(&mut image).unwrap();
+    for chunk in buf.chunks(chunk_size) {
+      if stream.feed(chunk).unwrap() == Progress::Done {
+        break;
+      }
+    }
+    stream.finish().unwrap();
+  }
+  image
+}
+
+fn decode_png_in_chunks(decoder: &mut NSPngDecoder, buf: &[u8], chunk_size: usize) -> Result<ColorImage, ()> {
+  let mut image = ColorImage::new();
+  {
+    let mut stream = decoder.begin(&mut image);
+    for chunk in buf.chunks(chunk_size) {
+      if stream.feed(chunk)? == Progress::Done {
+        break;
+      }
+    }
+    stream.finish()?;
+  }
+  Ok(image)
+}
+
+#[test]
+fn test_jpeg_chunked_feed() {
+  for &name in ["test.jpg", "test_progressive.jpg"].iter() {
+    let test_buf = read_test_file(name);
+    let mut whole = ColorImage::new();
+    NSJpegDecoder::new(true).decode(&test_buf, &mut whole).unwrap();
+    assert_eq!(whole.width(), 300);
+    assert_eq!(whole.height(), 300);
+    for &chunk_size in CHUNK_SIZES.iter() {
+      let chunked = decode_jpeg_in_chunks(&mut NSJpegDecoder::new(true), &test_buf, chunk_size);
+      assert_same_rgb(&chunked, &whole);
+    }
+  }
+}
+
+#[test]
+fn test_png_chunked_feed() {
+  for &name in ["test.png", "test_interlaced.png"].iter() {
+    let test_buf = read_test_file(name);
+    let mut whole = ColorImage::new();
+    NSPngDecoder::new(true).decode(&test_buf, &mut whole).unwrap();
+    assert_eq!(whole.width(), 300);
+    assert_eq!(whole.height(), 300);
+    for &chunk_size in CHUNK_SIZES.iter() {
+      let chunked = decode_png_in_chunks(&mut NSPngDecoder::new(true), &test_buf, chunk_size).unwrap();
+      assert_same_rgb(&chunked, &whole);
+    }
+  }
+}
+
+#[test]
+fn test_png_corrupt() {
+  let mut test_buf = read_test_file("test.png");
+  // Flip a byte inside the IDAT chunk, so that its CRC no longer matches.
+  test_buf[1149] ^= 0xff;
+  let mut image = ColorImage::new();
+  assert!(NSPngDecoder::new(true).decode(&test_buf, &mut image).is_err());
+  for &chunk_size in CHUNK_SIZES.iter() {
+    assert!(decode_png_in_chunks(&mut NSPngDecoder::new(true), &test_buf, chunk_size).is_err());
+  }
+  // Without even the header there is nothing to decode.
+  let test_buf = read_test_file("test.png");
+  assert!(decode_png_in_chunks(&mut NSPngDecoder::new(true), &test_buf[ .. 20], 7).is_err());
+}
+
+#[test]
+fn test_jpeg_scaled() {
+  let test_buf = read_test_file("test.jpg");
+  let full = ColorImage::decode(&test_buf).unwrap();
+  // 2/8 scale is the smallest that covers 75 x 75; 3/8 scale the smallest
+  // that covers 100 x 100.
+  let quarter = ColorImage::decode_with_max_size(&test_buf, 75, 75).unwrap();
+  assert_eq!(quarter.width(), 75);
+  assert_eq!(quarter.height(), 75);
+  let scaled = ColorImage::decode_with_max_size(&test_buf, 100, 100).unwrap();
+  assert_eq!(scaled.width(), 113);
+  assert_eq!(scaled.height(), 113);
+  // The scaled IDCT should come close to averaging the full image.
+  let mut boxed = ColorImage::decode(&test_buf).unwrap();
+  boxed.resize(75, 75);
+  assert!(mean_abs_diff(&quarter, &boxed) < 8.0);
+  // Targets at least as large as the image decode it at full size.
+  let same = ColorImage::decode_with_max_size(&test_buf, 300, 400).unwrap();
+  assert_same_rgb(&same, &full);
+  // Formats without a decoder fail rather than panic.
+  assert!(ColorImage::decode_with_max_size(b"GIF89a\x01\x00\x01\x00", 75, 75).is_err());
+}
+
+#[test]
+fn test_jpeg_region() {
+  // Without chroma subsampling the samples of a block only depend on the
+  // block itself, so a region decode is exactly the crop of a full decode.
+  let test_buf = read_test_file("test.jpg");
+  for &(x, y, width, height) in [(0, 0, 300, 300), (37, 50, 100, 80), (1, 299, 299, 1), (256, 8, 44, 17)].iter() {
+    let region = ColorImage::decode_region(&test_buf, x, y, width, height).unwrap();
+    let mut cropped = ColorImage::decode(&test_buf).unwrap();
+    cropped.crop(x, y, width, height);
+    assert_same_rgb(&region, &cropped);
+  }
+  assert!(ColorImage::decode_region(&test_buf, 0, 0, 0, 10).is_err());
+  assert!(ColorImage::decode_region(&test_buf, 250, 0, 51, 10).is_err());
+  assert!(ColorImage::decode_region(&test_buf, 0, 300, 10, 1).is_err());
+  assert!(ColorImage::decode_region(&test_buf, usize::max_value(), 0, 2, 1).is_err());
+}
+
+#[test]
+fn test_png_region() {
+  let test_buf = read_test_file("test.png");
+  let region = ColorImage::decode_region(&test_buf, 37, 50, 100, 80).unwrap();
+  let mut cropped = ColorImage::decode(&test_buf).unwrap();
+  cropped.crop(37, 50, 100, 80);
+  assert_same_rgb(&region, &cropped);
+  assert!(ColorImage::decode_region(&test_buf, 250, 0, 51, 10).is_err());
+  assert!(ColorImage::decode_region(&test_buf, 1, usize::max_value(), 1, 1).is_err());
+  assert!(ColorImage::decode_region(b"GIF89a\x01\x00\x01\x00", 0, 0, 1, 1).is_err());
+}
+
+#[test]
+fn test_jpeg_preview() {
+  let test_buf = read_test_file("test_progressive.jpg");
+  let full = ColorImage::decode(&test_buf).unwrap();
+  for &(max_scans, max_bytes, dc_scans_only) in [(1, 0, false), (0, 0, true), (0, 2000, false)].iter() {
+    let mut preview = ColorImage::new();
+    NSJpegDecoder::new(true)
+      .with_scan_limit(max_scans, max_bytes, dc_scans_only)
+      .decode(&test_buf, &mut preview)
+      .unwrap();
+    assert!(mean_abs_diff(&preview, &full) < 16.0);
+  }
+  // A DC-only preview at 1/8 scale.
+  let mut thumb = ColorImage::new();
+  NSJpegDecoder::new(true)
+    .with_target_size(38, 38)
+    .with_scan_limit(0, 0, true)
+    .decode(&test_buf, &mut thumb)
+    .unwrap();
+  assert_eq!(thumb.width(), 38);
+  assert_eq!(thumb.height(), 38);
+  // Enough scans for the whole image give the full decode.
+  let mut all_scans = ColorImage::new();
+  NSJpegDecoder::new(true)
+    .with_scan_limit(1000, 0, false)
+    .decode(&test_buf, &mut all_scans)
+    .unwrap();
+  assert_same_rgb(&all_scans, &full);
+}
+
+#[test]
+fn test_png_scaled() {
+  let test_buf = read_test_file("test_interlaced.png");
+  let full = ColorImage::decode(&test_buf).unwrap();
+  // The first three Adam7 passes hold every fourth pixel of every fourth
+  // row, which is exactly the 1/4 scale image.
+  let quarter = ColorImage::decode_with_max_size(&test_buf, 75, 75).unwrap();
+  assert_eq!(quarter.width(), 75);
+  assert_eq!(quarter.height(), 75);
+  for y in 0 .. 75 {
+    for x in 0 .. 75 {
+      assert_eq!(rgb_pixel(&quarter, x, y), rgb_pixel(&full, 4 * x, 4 * y), "pixel ({}, {})", x, y);
+    }
+  }
+  // Non-interlaced PNGs are decoded at full size.
+  let test_buf = read_test_file("test.png");
+  let unscaled = ColorImage::decode_with_max_size(&test_buf, 75, 75).unwrap();
+  assert_eq!(unscaled.width(), 300);
+  assert_eq!(unscaled.height(), 300);
+}
+
+#[test]
+fn test_decode_batch() {
+  use colorimage::batch::*;
+
+  let names = ["test.jpg", "", "test.png", "test_interlaced.png", "test_progressive.jpg"];
+  let bufs: Vec<Vec<u8>> = names.iter().map(|&name| match name {
+    "" => b"not an image, just garbage".to_vec(),
+    _ => read_test_file(name),
+  }).collect();
+  let inputs: Vec<&[u8]> = bufs.iter().map(|buf| &buf[ .. ]).collect();
+  let check = |results: Vec<Result<ColorImage, DecodeError>>| {
+    assert_eq!(results.len(), inputs.len());
+    for (idx, res) in results.iter().enumerate() {
+      match (names[idx], res) {
+        ("", &Err(e)) => assert_eq!(e, DecodeError::UnknownFormat),
+        ("", &Ok(_)) => panic!("garbage decoded"),
+        (_, &Ok(ref image)) => assert_same_rgb(image, &ColorImage::decode(inputs[idx]).unwrap()),
+        (name, &Err(e)) => panic!("{}: {:?}", name, e),
+      }
+    }
+  };
+  check(decode_batch(&inputs, &BatchOptions::default().with_num_threads(3)));
+  // The second batch reuses the workers of the first.
+  let mut decoder = BatchDecoder::new(BatchOptions::default().with_num_threads(3));
+  check(decoder.decode(&inputs));
+  check(decoder.decode(&inputs));
+}
+
+#[test]
+fn test_probe() {
+  let info = probe_image(&read_test_file("test.jpg")).unwrap();
+  assert_eq!(info.format, ImageFormat::Jpeg);
+  assert_eq!((info.width, info.height), (300, 300));
+  assert!(!info.progressive);
+  assert_eq!(info.jpeg_color_space, Some(JpegColorSpace::YCbCr));
+  assert_eq!(info.jpeg_subsampling, Some((1, 1)));
+  let info = probe_image(&read_test_file("test_progressive.jpg")).unwrap();
+  assert_eq!((info.width, info.height), (300, 300));
+  assert!(info.progressive);
+  assert_eq!(info.jpeg_subsampling, Some((2, 2)));
+  let info = probe_image(&read_test_file("test.png")).unwrap();
+  assert_eq!(info.format, ImageFormat::Png);
+  assert_eq!((info.width, info.height), (300, 300));
+  assert!(!info.progressive);
+  assert!(info.has_alpha);
+  assert_eq!(info.jpeg_subsampling, None);
+  let info = probe_image(&read_test_file("test_interlaced.png")).unwrap();
+  assert_eq!((info.width, info.height), (300, 300));
+  assert!(info.progressive);
+  assert_eq!(info.channels, 3);
+
+  // Truncated headers fail, or give what they have, but never panic.
+  for &name in ["test.jpg", "test_progressive.jpg", "test.png", "test_interlaced.png"].iter() {
+    let test_buf = read_test_file(name);
+    for n in 0 .. test_buf.len() {
+      let _ = probe_image(&test_buf[ .. n]);
+    }
+  }
+}
+
+#[test]
+fn test_decode_options() {
+  // test_icc.jpg is 4:2:0 with a non-sRGB profile, so without fancy
+  // upsampling the transform runs after libjpeg's merged upsampler rather
+  // than fused into its color conversion.
+  for &name in ["test_progressive.jpg", "test_icc.jpg"].iter() {
+    let test_buf = read_test_file(name);
+    let default = ColorImage::decode(&test_buf).unwrap();
+    let accurate = ColorImage::decode_with_options(&test_buf, DecodeOptions::accurate()).unwrap();
+    assert_same_rgb(&accurate, &default);
+    let balanced = ColorImage::decode_with_options(&test_buf, DecodeOptions::balanced()).unwrap();
+    assert!(mean_abs_diff(&balanced, &default) < 3.0);
+    let fast = ColorImage::decode_with_options(&test_buf, DecodeOptions::fast()).unwrap();
+    assert!(mean_abs_diff(&fast, &default) < 6.0);
+  }
+
+  // Turning color management off and on swaps the decoder's pooled context.
+  let test_buf = read_test_file("test_icc.jpg");
+  let managed = ColorImage::decode(&test_buf).unwrap();
+  let mut decoder = NSJpegDecoder::new(true);
+  decoder.set_options(DecodeOptions::default().with_color_mgmt(false));
+  let mut unmanaged = ColorImage::new();
+  decoder.decode(&test_buf, &mut unmanaged).unwrap();
+  assert!(mean_abs_diff(&unmanaged, &managed) > 1.0);
+  decoder.set_options(DecodeOptions::default());
+  let mut image = ColorImage::new();
+  decoder.decode(&test_buf, &mut image).unwrap();
+  assert_same_rgb(&image, &managed);
+  decoder.set_options(DecodeOptions::fast().with_color_mgmt(false));
+  let mut image = ColorImage::new();
+  decoder.decode(&test_buf, &mut image).unwrap();
+  assert!(mean_abs_diff(&image, &unmanaged) < 6.0);
+}
+
+#[test]
+fn test_jpeg_final_pass_only() {
+  // An output pass per scan must end on the same pixels as the single final
+  // pass of the default.
+  let test_buf = read_test_file("test_progressive.jpg");
+  let mut final_pass = ColorImage::new();
+  NSJpegDecoder::new(true).decode(&test_buf, &mut final_pass).unwrap();
+  let mut every_pass = ColorImage::new();
+  NSJpegDecoder::new(true)
+    .with_final_pass_only(false)
+    .decode(&test_buf, &mut every_pass)
+    .unwrap();
+  assert_same_rgb(&every_pass, &final_pass);
+  for &chunk_size in CHUNK_SIZES.iter() {
+    let mut decoder = NSJpegDecoder::new(true).with_final_pass_only(false);
+    assert_same_rgb(&decode_jpeg_in_chunks(&mut decoder, &test_buf, chunk_size), &final_pass);
+    let mut decoder = NSJpegDecoder::new(true);
+    assert_same_rgb(&decode_jpeg_in_chunks(&mut decoder, &test_buf, chunk_size), &final_pass);
+  }
+}
+
+#[test]
+fn test_png_final_pass_only() {
+  // Writing the rows of every Adam7 pass must end on the same pixels as
+  // writing them once after the final pass, as the default does.
+  let test_buf = read_test_file("test_interlaced.png");
+  let mut final_pass = ColorImage::new();
+  NSPngDecoder::new(true).decode(&test_buf, &mut final_pass).unwrap();
+  let mut every_pass = ColorImage::new();
+  NSPngDecoder::new(true)
+    .with_final_pass_only(false)
+    .decode(&test_buf, &mut every_pass)
+    .unwrap();
+  assert_same_rgb(&every_pass, &final_pass);
+  for &chunk_size in CHUNK_SIZES.iter() {
+    let mut decoder = NSPngDecoder::new(true).with_final_pass_only(false);
+    assert_same_rgb(&decode_png_in_chunks(&mut decoder, &test_buf, chunk_size).unwrap(), &final_pass);
+    let mut decoder = NSPngDecoder::new(true);
+    assert_same_rgb(&decode_png_in_chunks(&mut decoder, &test_buf, chunk_size).unwrap(), &final_pass);
+  }
+}
+
+#[test]
+fn test_decoder_reuse() {
+  // Decode with a fresh context from an empty pool.
+  let decode_fresh = |buf: &[u8], color_mgmt: bool| {
+    DecoderPool::clear();
+    let mut image = ColorImage::new();
+    match buf.starts_with(&JPEG_MAGICNUM) {
+      true  => NSJpegDecoder::new(color_mgmt).decode(buf, &mut image),
+      false => NSPngDecoder::new(color_mgmt).decode(buf, &mut image),
+    }.unwrap();
+    image
+  };
+
+  // Wide images before narrow ones, and baseline before progressive, so
+  // that each context is reused with smaller buffers and different state.
+  let mut jpeg = NSJpegDecoder::new(true);
+  let mut png = NSPngDecoder::new(true);
+  for &name in ["test_wide.jpg", "test.jpg", "test_progressive.jpg", "test_icc.jpg", "test.jpg",
+                "test_wide.png", "test_interlaced.png", "test.png"].iter() {
+    let test_buf = read_test_file(name);
+    let mut image = ColorImage::new();
+    match test_buf.starts_with(&JPEG_MAGICNUM) {
+      true  => jpeg.decode(&test_buf, &mut image),
+      false => png.decode(&test_buf, &mut image),
+    }.unwrap();
+    assert_same_rgb(&image, &decode_fresh(&test_buf, true));
+  }
+
+  // Turning color management off puts the context back in the pool and
+  // takes one without it; turning it back on swaps them again.
+  let test_buf = read_test_file("test_icc.jpg");
+  let managed = decode_fresh(&test_buf, true);
+  let unmanaged = decode_fresh(&test_buf, false);
+  DecoderPool::clear();
+  jpeg.set_options(DecodeOptions::default().with_color_mgmt(false));
+  let mut image = ColorImage::new();
+  jpeg.decode(&test_buf, &mut image).unwrap();
+  assert_same_rgb(&image, &unmanaged);
+  assert_eq!(DecoderPool::len(), (1, 0));
+  jpeg.set_options(DecodeOptions::default());
+  let mut image = ColorImage::new();
+  jpeg.decode(&test_buf, &mut image).unwrap();
+  assert_same_rgb(&image, &managed);
+  assert_eq!(DecoderPool::len(), (1, 0));
+
+  // Dropping the decoders returns their contexts.
+  drop(jpeg);
+  drop(png);
+  assert_eq!(DecoderPool::len(), (2, 1));
+  DecoderPool::clear();
+  assert_eq!(DecoderPool::len(), (0, 0));
+}
+
+/// A 4-byte pixel layout for `LayoutImage`.
+trait TestLayout: 'static {
+  fn pixel_format() -> PixelFormat;
+  /// An RGBX pixel in this layout.
+  fn permute(rgbx: &[u8]) -> [u8; 4];
+}
+
+struct Bgrx;
+struct Xrgb;
+
+impl TestLayout for Bgrx {
+  fn pixel_format() -> PixelFormat {
+    PixelFormat::Bgrx
+  }
+
+  fn permute(p: &[u8]) -> [u8; 4] {
+    [p[2], p[1], p[0], p[3]]
+  }
+}
+
+impl TestLayout for Xrgb {
+  fn pixel_format() -> PixelFormat {
+    PixelFormat::Xrgb
+  }
+
+  fn permute(p: &[u8]) -> [u8; 4] {
+    [p[3], p[0], p[1], p[2]]
+  }
+}
+
+/// A writer that stores rows in layout `L`, with or without handing out row
+/// buffers. Rows that arrive in any other layout are flagged.
+struct LayoutImage<L> {
+  width:        usize,
+  height:       usize,
+  data:         Vec<u8>,
+  row_buffers:  bool,
+  wrong_rows:   bool,
+  layout:       PhantomData<L>,
+}
+
+unsafe extern "C" fn layout_image_init_size<L>(img_p: *mut c_void, width: usize, height: usize) {
+  let img = &mut *(img_p as *mut LayoutImage<L>);
+  img.width = width;
+  img.height = height;
+  img.data = vec![0; 4 * width * height];
+}
+
+unsafe extern "C" fn layout_image_write_row_other<L>(img_p: *mut c_void, _row_idx: usize, _row_buf: *const u8, _row_width: usize) {
+  let img = &mut *(img_p as *mut LayoutImage<L>);
+  img.wrong_rows = true;
+}
+
+unsafe extern "C" fn layout_image_write_row<L>(img_p: *mut c_void, row_idx: usize, row_buf: *const u8, row_width: usize) {
+  let img = &mut *(img_p as *mut LayoutImage<L>);
+  assert_eq!(row_width, img.width);
+  let row = from_raw_parts(row_buf, 4 * row_width);
+  img.data[4 * row_width * row_idx .. 4 * row_width * (row_idx + 1)].copy_from_slice(row);
+}
+
+unsafe extern "C" fn layout_image_write_rows<L>(img_p: *mut c_void, row_idx: usize, num_rows: usize, rows_buf: *const u8, row_stride: usize, row_width: usize) {
+  for r in 0 .. num_rows {
+    layout_image_write_row::<L>(img_p, row_idx + r, rows_buf.offset((r * row_stride) as isize), row_width);
+  }
+}
+
+unsafe extern "C" fn layout_image_get_row_buffer<L>(img_p: *mut c_void, row_idx: usize) -> *mut u8 {
+  let img = &mut *(img_p as *mut LayoutImage<L>);
+  match img.row_buffers {
+    false => null_mut(),
+    true  => img.data[4 * img.width * row_idx .. ].as_mut_ptr(),
+  }
+}
+
+impl<L: TestLayout> ImageWriter for LayoutImage<L> {
+  fn callbacks() -> ImageWriterCallbacks {
+    ImageWriterCallbacks{
+      init_size:        Some(layout_image_init_size::<L>),
+      write_row_gray:   Some(layout_image_write_row_other::<L>),
+      write_row_grayx:  Some(layout_image_write_row_other::<L>),
+      write_row_rgb:    Some(layout_image_write_row_other::<L>),
+      write_row_rgbx:   Some(layout_image_write_row::<L>),
+      write_rows_rgbx:  Some(layout_image_write_rows::<L>),
+      get_row_buffer:   Some(layout_image_get_row_buffer::<L>),
+      parse_exif:       Some(generic_parse_exif),
+      pixel_format:     L::pixel_format() as _,
+    }
+  }
+}
+
+impl<L: TestLayout> LayoutImage<L> {
+  fn new(row_buffers: bool) -> LayoutImage<L> {
+    LayoutImage{
+      width:        0,
+      height:       0,
+      data:         vec![],
+      row_buffers:  row_buffers,
+      wrong_rows:   false,
+      layout:       PhantomData,
+    }
+  }
+
+  fn assert_same(&self, expected: &ColorImage, case: &str) {
+    assert!(!self.wrong_rows, "{}: rows not in the writer's layout", case);
+    assert_eq!(self.width, expected.width(), "{}", case);
+    assert_eq!(self.height, expected.height(), "{}", case);
+    for y in 0 .. self.height {
+      let expected_line = expected.raster_line(y);
+      for x in 0 .. self.width {
+        assert_eq!(&self.data[4 * (y * self.width + x) .. 4 * (y * self.width + x + 1)],
+                   &L::permute(&expected_line[4 * x .. 4 * x + 4])[ .. ],
+                   "{}: pixel ({}, {})", case, x, y);
+      }
+    }
+  }
+}
+
+const LAYOUT_CASES: [&'static str; 10] = [
+  "test.jpg", "test.jpg region", "test_progressive.jpg", "test_icc.jpg", "test_icc.jpg fast",
+  "test_cmyk.jpg", "test_gray_icc.jpg", "test.png", "test_interlaced.png", "test_interlaced.png every pass",
+];
+
+fn decode_layout_case<W: ImageWriter + 'static>(case: &str, writer: &mut W) {
+  let name = case.split(' ').next().unwrap();
+  let test_buf = read_test_file(name);
+  match case {
+    "test.jpg region" => NSJpegDecoder::new(true).with_region(37, 50, 100, 80).decode(&test_buf, writer),
+    "test_icc.jpg fast" => NSJpegDecoder::new(true).with_options(DecodeOptions::fast()).decode(&test_buf, writer),
+    "test_interlaced.png every pass" => NSPngDecoder::new(true).with_final_pass_only(false).decode(&test_buf, writer),
+    _ if name.ends_with(".png") => NSPngDecoder::new(true).decode(&test_buf, writer),
+    _ => NSJpegDecoder::new(true).decode(&test_buf, writer),
+  }.unwrap();
+}
+
+#[test]
+fn test_pixel_formats() {
+  // Each layout must hold the same pixels as the RGBX `ColorImage` decode,
+  // in its own channel order, whether the decoder writes rows or fills the
+  // writer's row buffers.
+  for &case in LAYOUT_CASES.iter() {
+    let mut expected = ColorImage::new();
+    decode_layout_case(case, &mut expected);
+    for &row_buffers in [false, true].iter() {
+      let mut bgrx = LayoutImage::<Bgrx>::new(row_buffers);
+      decode_layout_case(case, &mut bgrx);
+      bgrx.assert_same(&expected, case);
+      let mut xrgb = LayoutImage::<Xrgb>::new(row_buffers);
+      decode_layout_case(case, &mut xrgb);
+      xrgb.assert_same(&expected, case);
+    }
+    let mut packed = RasterImage::new();
+    decode_layout_case(case, &mut packed);
+    assert_eq!(packed.width(), expected.width(), "{}", case);
+    assert_eq!(packed.height(), expected.height(), "{}", case);
+    for y in 0 .. packed.height() {
+      for x in 0 .. packed.width() {
+        assert_eq!(&packed.raster_line(y)[3 * x .. 3 * x + 3], rgb_pixel(&expected, x, y), "{}: pixel ({}, {})", case, x, y);
+      }
+    }
+  }
+}